@@ -0,0 +1,975 @@
+/*
+    Host benchmark for the EEPROM hooks.
+
+    Replays traces of EEPROMConfigure/EEPROMRead/EEPROMWrite calls through flashpatch.cpp,
+    built with FLASH_SIM so the journal runs on Flash::Sim, and reports per-call latency
+    and flash wear for each trace. Reads are checked against a plain RAM copy of the
+    EEPROM; any mismatch or flash protocol error fails the run.
+
+    Usage: jflash_bench [--gen DIR] [--ring FILE]... [TRACE...]
+      With no traces, runs the built-in synthetic set. --gen writes that set to DIR.
+      --ring replays the ring left by the on-cart recorder in a save or RAM dump.
+*/
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <flash/sim.h>
+#include <jflash/jflash.h>
+#include <trace/trace.h>
+
+extern "C" {
+void ROMInit();
+u16 EEPROMConfigure(u16);
+u16 EEPROMWrite(u16 addr, u8 data[8], bool8 wait);
+u16 EEPROMRead(u16 address, u8 data[8]);
+}
+
+namespace {
+
+// Part the traces run on. flashpatch.cpp drives it as its fallback part, it isn't one of the known ones.
+constexpr const Flash::Info &Part = Flash::SST39SF512;
+
+// Whether the hooks tell the part apart by its IDs; a build listing only some of them in
+// FLASHPATCH_PARTS (make PART=...) drives the others as Part.
+#ifdef FLASHPATCH_PARTS
+template <const Flash::Info &...Known> constexpr bool Listed(const Flash::Info &part) { return ((&part == &Known) || ...); }
+constexpr bool Built(const Flash::Info &part) { return Listed<FLASHPATCH_PARTS>(part); }
+#else
+constexpr bool Built(const Flash::Info &) { return true; }
+#endif
+
+constexpr u32 EEPROMSize = 8 * 1024;
+constexpr u32 NumBlocks = EEPROMSize / Trace::DataSize;
+constexpr u32 FrameCycles = 280896; // one 59.73Hz video frame
+
+struct NamedTrace {
+    std::string name;
+    std::vector<u8> bytes;
+};
+
+class Builder {
+  public:
+    explicit Builder(std::string name) : name(std::move(name)) {}
+
+    Builder &Flags(u16 f) {
+        flags = f;
+        return *this;
+    }
+    Builder &Boot(u32 delta = 0) { return Add(Trace::BOOT, 0, nullptr, false, delta); }
+    Builder &Configure(u32 delta = 0) { return Add(Trace::CONFIGURE, 0, nullptr, false, delta); }
+    Builder &Read(u16 addr, u32 delta = 0) { return Add(Trace::READ, addr, nullptr, false, delta); }
+    Builder &Write(u16 addr, const u8 *data, bool wait = true, u32 delta = 0) { return Add(Trace::WRITE, addr, data, wait, delta); }
+
+    NamedTrace Finish() const {
+        Trace::Header header{.magic = Trace::Magic, .version = Trace::Version, .flags = flags, .count = count};
+        NamedTrace out{name, {}};
+        out.bytes.resize(sizeof(header));
+        memcpy(out.bytes.data(), &header, sizeof(header));
+        out.bytes.insert(out.bytes.end(), body.begin(), body.end());
+        return out;
+    }
+
+  private:
+    Builder &Add(u8 op, u16 addr, const u8 *data, bool wait, u32 delta) {
+        Trace::Entry e{.op = op, .wait = (u8)wait, .addr = addr, .delta = delta};
+        const u8 *p = reinterpret_cast<const u8 *>(&e);
+        body.insert(body.end(), p, p + sizeof(e));
+        if (op == Trace::WRITE) {
+            body.insert(body.end(), data, data + Trace::DataSize);
+        }
+        count++;
+        return *this;
+    }
+
+    std::string name;
+    std::vector<u8> body;
+    u32 count = 0;
+    u16 flags = 0;
+};
+
+// Small deterministic generator so the synthetic traces never change between runs.
+class Rng {
+  public:
+    explicit Rng(u32 seed) : state(seed) {}
+    u32 Next() {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+
+  private:
+    u32 state;
+};
+
+void Fill(u8 *data, Rng &rng) {
+    for (u32 i = 0; i < Trace::DataSize; i++) {
+        data[i] = (u8)rng.Next();
+    }
+}
+
+// The game saves its whole 8 KB EEPROM a few times, a second of play apart.
+NamedTrace FullSave() {
+    Builder b("full-save");
+    Rng rng(1);
+    u8 data[Trace::DataSize];
+    b.Boot().Configure();
+    for (int round = 0; round < 6; round++) {
+        for (u32 addr = 0; addr < NumBlocks; addr++) {
+            Fill(data, rng);
+            b.Write(addr, data, true, addr == 0 ? 60 * FrameCycles : 0);
+        }
+    }
+    return b.Finish();
+}
+
+// The game writes its whole 8 KB EEPROM on every save, though only a few blocks changed since.
+NamedTrace FullResave() {
+    Builder b("full-resave");
+    Rng rng(9);
+    static u8 blocks[NumBlocks][Trace::DataSize];
+    b.Boot().Configure();
+    for (auto &block : blocks) {
+        Fill(block, rng);
+    }
+    for (int round = 0; round < 20; round++) {
+        for (int i = 0; i < 4; i++) {
+            Fill(blocks[rng.Next() % NumBlocks], rng);
+        }
+        for (u32 addr = 0; addr < NumBlocks; addr++) {
+            b.Write(addr, blocks[addr], true, addr == 0 ? 60 * FrameCycles : 0);
+        }
+    }
+    b.Boot(60 * FrameCycles).Configure();
+    for (u32 addr = 0; addr < NumBlocks; addr++) {
+        b.Read(addr);
+    }
+    return b.Finish();
+}
+
+// Autosave that rewrites the same few blocks with small changes every few seconds.
+NamedTrace HotSlot() {
+    Builder b("hot-slot");
+    Rng rng(2);
+    u8 slots[4][Trace::DataSize];
+    b.Boot().Configure();
+    for (auto &slot : slots) {
+        Fill(slot, rng);
+    }
+    for (int save = 0; save < 2500; save++) {
+        for (u32 i = 0; i < 4; i++) {
+            slots[i][rng.Next() % Trace::DataSize] = (u8)rng.Next();
+            b.Write(16 + i, slots[i], true, i == 0 ? 300 * FrameCycles : 0);
+        }
+    }
+    return b.Finish();
+}
+
+// Saves of 64 blocks written back to back without wait, the game looking at a few of them
+// right after, and finally a power cycle a second after the last save.
+NamedTrace BurstSave() {
+    Builder b("burst-save");
+    Rng rng(5);
+    u8 data[Trace::DataSize];
+    b.Boot().Configure();
+    for (int save = 0; save < 100; save++) {
+        u32 first = (rng.Next() % (NumBlocks / 64)) * 64;
+        for (u32 i = 0; i < 64; i++) {
+            Fill(data, rng);
+            b.Write(first + i, data, false, i == 0 ? 120 * FrameCycles : 0);
+        }
+        for (u32 i = 0; i < 4; i++) {
+            b.Read(first + rng.Next() % 64);
+        }
+    }
+    b.Boot(60 * FrameCycles).Configure();
+    for (u32 addr = 0; addr < NumBlocks; addr++) {
+        b.Read(addr);
+    }
+    return b.Finish();
+}
+
+// A save built up over a session, then a power cycle and the game loading every block.
+NamedTrace BootReadAll() {
+    Builder b("boot-read-all");
+    Rng rng(3);
+    u8 data[Trace::DataSize];
+    b.Boot().Configure();
+    for (u32 addr = 0; addr < NumBlocks; addr++) {
+        Fill(data, rng);
+        b.Write(addr, data);
+    }
+    for (int i = 0; i < 1500; i++) {
+        Fill(data, rng);
+        b.Write(rng.Next() % NumBlocks, data, true, FrameCycles);
+    }
+    b.Boot(60 * FrameCycles).Configure();
+    for (u32 addr = 0; addr < NumBlocks; addr++) {
+        b.Read(addr);
+    }
+    return b.Finish();
+}
+
+// Random saves with the console switched off every few hundred writes, then a full load.
+NamedTrace PowerCycles() {
+    Builder b("power-cycles");
+    Rng rng(4);
+    u8 data[Trace::DataSize];
+    b.Boot().Configure();
+    for (int i = 0; i < 12000; i++) {
+        Fill(data, rng);
+        b.Write(rng.Next() % NumBlocks, data, true, FrameCycles);
+        if (rng.Next() % 300 == 0) {
+            b.Boot(60 * FrameCycles).Configure();
+        }
+    }
+    b.Boot(60 * FrameCycles).Configure();
+    for (u32 addr = 0; addr < NumBlocks; addr++) {
+        b.Read(addr);
+    }
+    return b.Finish();
+}
+
+// Play counters and flags in a few dozen blocks ticking up a byte or two at a time, read back
+// now and then, with power cycles in between and a full load at the end.
+NamedTrace Counters() {
+    Builder b("counters");
+    Rng rng(7);
+    static u8 blocks[32][Trace::DataSize];
+    b.Boot().Configure();
+    for (u32 i = 0; i < 32; i++) {
+        Fill(blocks[i], rng);
+        b.Write(i * 8, blocks[i]);
+    }
+    for (int i = 0; i < 12000; i++) {
+        u32 n = rng.Next() % 32;
+        u8 *block = blocks[n];
+        if (++block[0] == 0) {
+            block[1]++;
+        }
+        if (rng.Next() % 8 == 0) {
+            block[4 + rng.Next() % 4] ^= 1 << (rng.Next() % 8);
+        }
+        b.Write(n * 8, block, true, FrameCycles);
+        if (rng.Next() % 16 == 0) {
+            b.Read(rng.Next() % 32 * 8);
+        }
+        if (rng.Next() % 500 == 0) {
+            b.Boot(60 * FrameCycles).Configure();
+        }
+    }
+    b.Boot(60 * FrameCycles).Configure();
+    for (u32 addr = 0; addr < NumBlocks; addr++) {
+        b.Read(addr);
+    }
+    return b.Finish();
+}
+
+// Achievement and "slot used" flags stored active-low: every save clears a bit or two of one
+// of a few dozen blocks, until they run out and get reset. Power cycles in between, a full
+// load at the end.
+NamedTrace Flags() {
+    Builder b("flags");
+    Rng rng(8);
+    static u8 blocks[32][Trace::DataSize];
+    memset(blocks, 0xFF, sizeof(blocks));
+    b.Boot().Configure();
+    for (int i = 0; i < 8000; i++) {
+        u32 n = rng.Next() % 32;
+        u8 *block = blocks[n];
+        block[rng.Next() % Trace::DataSize] &= ~(1 << (rng.Next() % 8));
+        if (rng.Next() % 64 == 0) {
+            memset(block, 0xFF, Trace::DataSize);
+        }
+        b.Write(n * 8 + 1, block, true, FrameCycles);
+        if (rng.Next() % 500 == 0) {
+            b.Boot(60 * FrameCycles).Configure();
+        }
+    }
+    b.Boot(60 * FrameCycles).Configure();
+    for (u32 addr = 0; addr < NumBlocks; addr++) {
+        b.Read(addr);
+    }
+    return b.Finish();
+}
+
+// A save in a few blocks rewritten every few seconds, the game probing blocks it never wrote
+// right after each save, e.g. looking for a free slot.
+NamedTrace Probes() {
+    Builder b("probes");
+    Rng rng(10);
+    static u8 blocks[16][Trace::DataSize];
+    b.Boot().Configure();
+    for (int save = 0; save < 1500; save++) {
+        for (u32 i = 0; i < 16; i++) {
+            Fill(blocks[i], rng);
+            b.Write(i, blocks[i], true, i == 0 ? 180 * FrameCycles : 0);
+        }
+        for (u32 i = 0; i < 4; i++) {
+            b.Read(16 + rng.Next() % (NumBlocks - 16));
+        }
+    }
+    return b.Finish();
+}
+
+struct Latencies {
+    std::vector<u64> cycles;
+
+    void Add(u64 c) { cycles.push_back(c); }
+
+    u64 Percentile(u32 p) {
+        if (cycles.empty()) {
+            return 0;
+        }
+        std::sort(cycles.begin(), cycles.end());
+        size_t i = (cycles.size() * p + 99) / 100;
+        return cycles[i == 0 ? 0 : i - 1];
+    }
+};
+
+double Micros(u64 cycles) { return cycles * 1e6 / Flash::Sim::CyclesPerSecond; }
+
+struct Result {
+    Latencies latency[4];
+    u32 programs = 0;
+    u32 sectorErases = 0;
+    u32 chipErases = 0;
+    u32 stalls = 0;
+    u32 mismatches = 0;
+    u32 protocolErrors = 0;
+    u32 errors = 0;
+};
+
+bool Replay(const NamedTrace &trace, Result &r) {
+    const u8 *p = trace.bytes.data();
+    const u8 *end = p + trace.bytes.size();
+
+    Trace::Header header;
+    if (trace.bytes.size() < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, p, sizeof(header));
+    p += sizeof(header);
+    if (header.magic != Trace::Magic || header.version != Trace::Version) {
+        return false;
+    }
+
+    Flash::Sim::Reset(Part);
+    ROMInit();
+
+    // Data from a recorded ring is only known for blocks the trace itself wrote.
+    const bool hashed = (header.flags & Trace::FLAG_HASHED_DATA) != 0;
+    static u8 expected[NumBlocks][Trace::DataSize];
+    static bool written[NumBlocks];
+    memset(expected, 0xFF, sizeof(expected));
+    memset(written, 0, sizeof(written));
+
+    for (u32 n = 0; n < header.count; n++) {
+        Trace::Entry e;
+        if (end - p < (ptrdiff_t)sizeof(e)) {
+            return false;
+        }
+        memcpy(&e, p, sizeof(e));
+        p += sizeof(e);
+
+        u8 data[Trace::DataSize];
+        if (e.op == Trace::WRITE) {
+            if (end - p < (ptrdiff_t)Trace::DataSize) {
+                return false;
+            }
+            memcpy(data, p, Trace::DataSize);
+            p += Trace::DataSize;
+        }
+        if (e.op > Trace::BOOT || (e.op != Trace::BOOT && e.op != Trace::CONFIGURE && e.addr >= NumBlocks)) {
+            return false;
+        }
+
+        Flash::Sim::Idle(e.delta);
+        const Flash::Sim::Stats before = Flash::Sim::GetStats();
+
+        u16 result = 0;
+        switch (e.op) {
+        case Trace::BOOT:
+            Flash::Sim::PowerCycle();
+            ROMInit();
+            break;
+        case Trace::CONFIGURE:
+            result = EEPROMConfigure(EEPROMSize);
+            break;
+        case Trace::READ:
+            result = EEPROMRead(e.addr, data);
+            if ((written[e.addr] || !hashed) && memcmp(data, expected[e.addr], Trace::DataSize) != 0) {
+                r.mismatches++;
+            }
+            break;
+        case Trace::WRITE:
+            memcpy(expected[e.addr], data, Trace::DataSize);
+            written[e.addr] = true;
+            result = EEPROMWrite(e.addr, data, e.wait);
+            break;
+        }
+
+        const Flash::Sim::Stats &after = Flash::Sim::GetStats();
+        r.latency[e.op].Add(after.cycles - before.cycles);
+        // erases run in the background, a write only stalls if it has to wait for one
+        if (e.op == Trace::WRITE && after.eraseWaitCycles != before.eraseWaitCycles) {
+            r.stalls++;
+        }
+        if (result != 0) {
+            r.errors++;
+        }
+    }
+
+    // erases started from the timer interrupt happen between calls, so these are counted over the whole run
+    const Flash::Sim::Stats &s = Flash::Sim::GetStats();
+    r.programs = s.programs;
+    r.sectorErases = s.sectorErases;
+    r.chipErases = s.chipErases;
+    r.protocolErrors = s.rejected + s.violations;
+    return true;
+}
+
+void Report(const char *name, Result &r) {
+    static const char *const opNames[] = {"configure", "read", "write", "boot"};
+    printf("%s\n", name);
+    for (int op : {Trace::CONFIGURE, Trace::READ, Trace::WRITE}) {
+        Latencies &l = r.latency[op];
+        if (l.cycles.empty()) {
+            continue;
+        }
+        printf("  %-9s %7zu calls  p50 %10.1f us  p99 %10.1f us  max %10.1f us\n", opNames[op], l.cycles.size(), Micros(l.Percentile(50)), Micros(l.Percentile(99)),
+               Micros(l.Percentile(100)));
+    }
+    printf("  programmed %u bytes, %u sector erases, %u chip erases, %u compaction stalls\n", r.programs, r.sectorErases, r.chipErases, r.stalls);
+    if (r.mismatches || r.protocolErrors || r.errors) {
+        printf("  FAILED: %u read mismatches, %u flash protocol errors, %u hook errors\n", r.mismatches, r.protocolErrors, r.errors);
+    }
+}
+
+bool Load(const char *path, NamedTrace &out) {
+    FILE *f = fopen(path, "rb");
+    if (f == nullptr) {
+        return false;
+    }
+    out.name = path;
+    u8 buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        out.bytes.insert(out.bytes.end(), buf, buf + n);
+    }
+    fclose(f);
+    return true;
+}
+
+// Finds a recorder ring anywhere in a dump and turns it into a trace, oldest call first.
+bool LoadRing(const char *path, NamedTrace &out) {
+    NamedTrace dump;
+    if (!Load(path, dump)) {
+        return false;
+    }
+
+    const std::vector<u8> &bytes = dump.bytes;
+    for (size_t off = 0; off + sizeof(Trace::RingHeader) <= bytes.size(); off += 4) {
+        Trace::RingHeader header;
+        memcpy(&header, &bytes[off], sizeof(header));
+        if (header.magic != Trace::RingMagic || header.version != Trace::RingVersion || header.capacity == 0 ||
+            off + sizeof(header) + header.capacity * sizeof(Trace::RingEntry) > bytes.size()) {
+            continue;
+        }
+
+        Builder b(std::string(path) + " (ring)");
+        b.Flags(Trace::FLAG_HASHED_DATA);
+
+        u32 count = std::min<u32>(header.next, header.capacity);
+        u32 first = header.next - count;
+        u32 lastTime = 0;
+        for (u32 i = 0; i < count; i++) {
+            Trace::RingEntry e;
+            memcpy(&e, &bytes[off + sizeof(header) + ((first + i) % header.capacity) * sizeof(e)], sizeof(e));
+            u32 delta = i == 0 ? 0 : e.time - lastTime;
+            lastTime = e.time;
+
+            switch (e.op) {
+            case Trace::CONFIGURE:
+                b.Configure(delta);
+                break;
+            case Trace::READ:
+                b.Read(e.addr, delta);
+                break;
+            case Trace::WRITE: {
+                // stable stand-in for the data: equal values map to equal blocks
+                u8 data[Trace::DataSize];
+                for (u32 j = 0; j < Trace::DataSize; j++) {
+                    data[j] = (u8)(e.hash >> (8 * (j % 4))) ^ (j < 4 ? 0x00 : 0x5A);
+                }
+                b.Write(e.addr, data, e.wait, delta);
+                break;
+            }
+            default:
+                return false;
+            }
+        }
+
+        out = b.Finish();
+        return true;
+    }
+
+    return false;
+}
+
+// The frame address scan on its own: a full partition walked for the free marker, with every
+// address reported as mount does, and for the last copy of one variable.
+void ScanKernel() {
+    using Journal = JFlash::Journal<Part, EEPROMSize, Flash::Sim>;
+    using Chip = Journal::Chip;
+    constexpr u32 Frames = Journal::PartitionMaxFrames;
+
+    Flash::Sim::Reset(Part);
+    auto frames = reinterpret_cast<JFlash::Frame *>(reinterpret_cast<Journal::Partition *>(Flash::Sim::Image())->frames);
+    for (u32 i = 0; i < Frames; i++) {
+        frames[i].addr = i % NumBlocks;
+    }
+
+    static u16 addrs[Frames];
+    u64 start = Flash::Sim::GetStats().cycles;
+    u32 n = Chip::Scan((const u8 *)&frames[0].addr, sizeof(JFlash::Frame), Frames, 0xFFFF, addrs);
+    u64 all = Flash::Sim::GetStats().cycles - start;
+
+    start = Flash::Sim::GetStats().cycles;
+    u32 last = Chip::ScanLast((const u8 *)&frames[0].addr, sizeof(JFlash::Frame), Frames, 5);
+    u64 lastCycles = Flash::Sim::GetStats().cycles - start;
+
+    printf("scan-kernel\n");
+    printf("  %u frames to free marker %10.1f us  %6.1f cycles/frame\n", n, Micros(all), (double)all / n);
+    printf("  last copy at %4u        %10.1f us  %6.1f cycles/frame\n", last, Micros(lastCycles), (double)lastCycles / Frames);
+}
+
+// A save written by the first versions, with 16-byte frames: it has to mount as it is, and the
+// next compaction moves it to the current layout.
+bool LegacyImage() {
+    using Journal = JFlash::Journal<Part, EEPROMSize, Flash::Sim>;
+
+    Flash::Sim::Reset(Part);
+    auto partition = reinterpret_cast<Journal::Partition *>(Flash::Sim::Image());
+    partition->header.receiving = 0;
+    partition->header.active = 0;
+    auto frames = reinterpret_cast<JFlash::LegacyFrame *>(partition->frames);
+
+    Rng rng(6);
+    static u8 expected[NumBlocks][Trace::DataSize];
+    memset(expected, 0xFF, sizeof(expected));
+    const u32 oldFrames = Journal::LegacyMaxFrames - 100;
+    for (u32 i = 0; i < oldFrames; i++) {
+        u16 addr = rng.Next() % NumBlocks;
+        Fill(expected[addr], rng);
+        frames[i] = JFlash::LegacyFrame{.addr = addr};
+        memcpy(frames[i].data.data, expected[addr], Trace::DataSize);
+    }
+
+    u32 mismatches = 0;
+    auto check = [&] {
+        for (u32 addr = 0; addr < NumBlocks; addr++) {
+            u8 data[Trace::DataSize];
+            EEPROMRead(addr, data);
+            mismatches += memcmp(data, expected[addr], Trace::DataSize) != 0;
+        }
+    };
+
+    ROMInit();
+    EEPROMConfigure(EEPROMSize);
+    check();
+
+    for (u32 i = 0; i < 2000; i++) {
+        u16 addr = rng.Next() % NumBlocks;
+        Fill(expected[addr], rng);
+        EEPROMWrite(addr, expected[addr], true);
+    }
+    Flash::Sim::Idle(60 * FrameCycles);
+    check();
+
+    Flash::Sim::PowerCycle();
+    ROMInit();
+    EEPROMConfigure(EEPROMSize);
+    check();
+
+    // with less room for frames, e.g. next to sector summaries, the writes take a second compaction
+    const auto other = reinterpret_cast<Journal::Partition *>(Flash::Sim::Image() + Part.type.romSize / 2);
+    const auto active = other->header.state == JFlash::ACTIVE ? other : partition;
+    const bool migrated = active->header.layout == JFlash::COMPACT && active->header.state == JFlash::ACTIVE;
+    const Flash::Sim::Stats &s = Flash::Sim::GetStats();
+    const u32 protocolErrors = s.rejected + s.violations;
+
+    printf("legacy-image\n");
+    printf("  %u 16-byte frames mounted, %s to the compact layout\n", oldFrames, migrated ? "migrated" : "NOT migrated");
+    if (mismatches || protocolErrors || !migrated) {
+        printf("  FAILED: %u read mismatches, %u flash protocol errors\n", mismatches, protocolErrors);
+        return false;
+    }
+    return true;
+}
+
+// Header states a power loss can leave behind, set by hand on a journal with data in it. Every
+// one has to mount with the data intact and without formatting the chip.
+bool Recovery() {
+    using Journal = JFlash::Journal<Part, EEPROMSize, Flash::Sim>;
+    struct Case {
+        const char *name;
+        JFlash::State live;
+        JFlash::State other;
+    };
+    const Case cases[] = {
+        {"format cut short", JFlash::RECEIVING, JFlash::ERASED},
+        {"compaction not started", JFlash::SENDING, JFlash::ERASED},
+        {"receiving not marked sending", JFlash::ACTIVE, JFlash::RECEIVING},
+        {"erase cut short", JFlash::ACTIVE, JFlash::ERASING},
+    };
+
+    printf("recovery\n");
+    bool ok = true;
+    for (const Case &c : cases) {
+        Flash::Sim::Reset(Part);
+        ROMInit();
+        EEPROMConfigure(EEPROMSize);
+
+        Rng rng(10);
+        static u8 expected[NumBlocks][Trace::DataSize];
+        memset(expected, 0xFF, sizeof(expected));
+        for (u32 i = 0; i < 300; i++) {
+            u16 addr = rng.Next() % NumBlocks;
+            Fill(expected[addr], rng);
+            EEPROMWrite(addr, expected[addr], true);
+        }
+
+        // the journal formatted partition 0 and never filled it
+        auto live = reinterpret_cast<Journal::Partition *>(Flash::Sim::Image());
+        auto other = reinterpret_cast<Journal::Partition *>(Flash::Sim::Image() + Part.type.romSize / 2);
+        live->header.state = c.live;
+        other->header.state = c.other;
+        if (c.other != JFlash::ERASED) {
+            memset(other->frames, 0x5A, 64);
+        }
+
+        Flash::Sim::PowerCycle();
+        const u32 chipErases = Flash::Sim::GetStats().chipErases;
+        ROMInit();
+        EEPROMConfigure(EEPROMSize);
+        Flash::Sim::Idle(60 * FrameCycles);
+
+        u32 mismatches = 0;
+        for (u32 addr = 0; addr < NumBlocks; addr++) {
+            u8 data[Trace::DataSize];
+            EEPROMRead(addr, data);
+            mismatches += memcmp(data, expected[addr], Trace::DataSize) != 0;
+        }
+        const Flash::Sim::Stats &s = Flash::Sim::GetStats();
+        const bool formatted = s.chipErases != chipErases;
+        const bool otherErased = c.other == JFlash::ERASED || other->header.state == JFlash::ERASED;
+
+        printf("  %-30s %s\n", c.name, mismatches || formatted || !otherErased || s.rejected || s.violations ? "FAILED" : "ok");
+        if (mismatches || formatted || !otherErased || s.rejected || s.violations) {
+            printf("  %u read mismatches, %s, other partition %s\n", mismatches, formatted ? "formatted" : "not formatted", otherErased ? "erased" : "left");
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+// A frame cut short by a power loss at the end of the journal: it must not count as the
+// variable's newest copy, neither on the next mount nor once records were appended after it,
+// including a delta made against the frame before it.
+bool TornFrame() {
+    using Journal = JFlash::Journal<Part, EEPROMSize, Flash::Sim>;
+    Flash::Sim::Reset(Part);
+    ROMInit();
+    EEPROMConfigure(EEPROMSize);
+
+    u8 expected[2][Trace::DataSize];
+    memset(expected[0], 0x11, Trace::DataSize);
+    memset(expected[1], 0x22, Trace::DataSize);
+    EEPROMWrite(5, expected[0], true);
+
+    // the address and three data bytes made it, the rest of the frame didn't
+    u8 *frames = reinterpret_cast<Journal::Partition *>(Flash::Sim::Image())->frames;
+    u32 offset = 0;
+    for (u16 addr; (addr = frames[offset] | frames[offset + 1] << 8) != 0xFFFF;) {
+        offset += (addr & JFlash::Delta::Flag) ? sizeof(JFlash::Delta) : sizeof(JFlash::Frame);
+    }
+    auto torn = reinterpret_cast<JFlash::Frame *>(frames + offset);
+    torn->addr = 5;
+    torn->data.data[0] = torn->data.data[1] = torn->data.data[2] = 0x00;
+
+    u32 mismatches = 0;
+    auto check = [&] {
+        Flash::Sim::PowerCycle();
+        ROMInit();
+        EEPROMConfigure(EEPROMSize);
+        u8 data[Trace::DataSize];
+        EEPROMRead(5, data);
+        mismatches += memcmp(data, expected[0], Trace::DataSize) != 0;
+        EEPROMRead(7, data);
+        mismatches += memcmp(data, expected[1], Trace::DataSize) != 0;
+    };
+
+    memset(expected[1], 0xFF, Trace::DataSize);
+    check();
+    memset(expected[1], 0x22, Trace::DataSize);
+    EEPROMWrite(7, expected[1], true);
+    check();
+    expected[0][4] = 0x33;
+    EEPROMWrite(5, expected[0], true);
+    check();
+
+    const Flash::Sim::Stats &s = Flash::Sim::GetStats();
+    const bool failed = mismatches || s.rejected || s.violations;
+    printf("torn-frame\n  %u read mismatches  %s\n", mismatches, failed ? "FAILED" : "ok");
+    return !failed;
+}
+
+// A journal without an index looks variables up on flash. Reads have to match after writes, power
+// cycles and compactions, and the sector summaries should spare lookups most of the scan: the same
+// partition is read again once its header no longer says it keeps them.
+bool Summaries() {
+    using Journal = JFlash::Journal<Part, EEPROMSize, Flash::Sim, 16, false, false>;
+    Flash::Sim::Reset(Part);
+    Journal::Init();
+
+    Rng rng(17);
+    static u8 expected[NumBlocks][Trace::DataSize];
+    memset(expected, 0xFF, sizeof(expected));
+    u32 errors = 0;
+    for (u32 i = 0; i < 6000; i++) {
+        // half the variables, so the other half is looked up without being found
+        u16 addr = rng.Next() % (NumBlocks / 2);
+        Fill(expected[addr], rng);
+        JFlash::Variable data;
+        memcpy(data.data, expected[addr], Trace::DataSize);
+        errors += Journal::WriteVar(addr, data) != 0;
+        if (i % 1000 == 999) {
+            Flash::Sim::PowerCycle();
+            Journal::Init();
+        }
+        Flash::Sim::Idle(FrameCycles);
+    }
+
+    u32 mismatches = 0;
+    auto check = [&](Latencies &reads) {
+        Flash::Sim::PowerCycle();
+        Journal::Init();
+        for (u32 addr = 0; addr < NumBlocks; addr++) {
+            const u64 start = Flash::Sim::GetStats().cycles;
+            const JFlash::Variable data = Journal::ReadVar(addr);
+            reads.Add(Flash::Sim::GetStats().cycles - start);
+            mismatches += memcmp(data.data, expected[addr], Trace::DataSize) != 0;
+        }
+    };
+    Latencies summarized, scanned;
+    check(summarized);
+    Journal::ActivePartition()->header.summaries = 0xFF;
+    check(scanned);
+
+    const Flash::Sim::Stats &s = Flash::Sim::GetStats();
+    const bool failed = mismatches || errors || s.rejected || s.violations;
+    printf("summaries\n");
+    printf("  read p50 %8.1f us  max %8.1f us  without summaries p50 %8.1f us  max %8.1f us\n", Micros(summarized.Percentile(50)), Micros(summarized.Percentile(100)),
+           Micros(scanned.Percentile(50)), Micros(scanned.Percentile(100)));
+    printf("  %u read mismatches, %u write errors  %s\n", mismatches, errors, failed ? "FAILED" : "ok");
+    return !failed;
+}
+
+// Chips that only read reliably with more wait states than the Flash::Info of the part gives.
+// Calibration at boot has to find exactly the fastest wait each one takes, and the save has to
+// read back with it.
+bool WaitStates() {
+    using Journal = JFlash::Journal<Part, EEPROMSize, Flash::Sim>;
+    const u16 waits[] = {WAITCNT_SRAM_2, WAITCNT_SRAM_3, WAITCNT_SRAM_4, WAITCNT_SRAM_8};
+    auto count = [](u16 wait) { return wait == WAITCNT_SRAM_8 ? 8 : 4 - wait; };
+
+    printf("wait-states\n");
+    bool ok = true;
+    for (u16 fastest : waits) {
+        Flash::Sim::Reset(Part);
+        ROMInit();
+        EEPROMConfigure(EEPROMSize);
+        Rng rng(13);
+        static u8 expected[NumBlocks][Trace::DataSize];
+        for (u32 addr = 0; addr < 64; addr++) {
+            Fill(expected[addr], rng);
+            EEPROMWrite(addr, expected[addr], true);
+        }
+
+        Flash::Sim::PowerCycle();
+        Flash::Sim::SetFastestWait(fastest);
+        ROMInit();
+        const bool calibrated = Journal::CalibrateWait();
+        const u16 found = *Flash::Sim::ReadWaitCache();
+        EEPROMConfigure(EEPROMSize);
+        const u64 start = Flash::Sim::GetStats().cycles;
+        u32 mismatches = 0;
+        for (u32 addr = 0; addr < 64; addr++) {
+            u8 data[Trace::DataSize];
+            EEPROMRead(addr, data);
+            mismatches += memcmp(data, expected[addr], Trace::DataSize) != 0;
+        }
+        const u64 reads = Flash::Sim::GetStats().cycles - start;
+
+        const bool failed = !calibrated || found != fastest || mismatches;
+        printf("  fastest %u wait states: calibrated to %u, read %6.1f us  %s\n", count(fastest), count(found), Micros(reads / 64), failed ? "FAILED" : "ok");
+        ok = ok && !failed;
+    }
+    return ok;
+}
+
+// Every part the patch knows by its IDs, each driven through a save and a power cycle.
+bool Parts() {
+    struct Case {
+        const char *name;
+        const Flash::Info &part;
+    };
+    const Case cases[] = {
+        {"SST39VF512", Flash::SST39VF512},
+        {"MX29L512", Flash::MX29L512},
+        {"MN63F805MNP", Flash::MN63F805MNP},
+        {"MX29L010", Flash::MX29L010},
+        {"LE26FV10N1TS", Flash::LE26FV10N1TS},
+        {"AT29LV512", Flash::AT29LV512},
+    };
+
+    printf("parts\n");
+    bool ok = true;
+    for (const Case &c : cases) {
+        if (!Built(c.part)) {
+            printf("  %-14s not in FLASHPATCH_PARTS\n", c.name);
+            continue;
+        }
+        Flash::Sim::Reset(c.part);
+        ROMInit();
+        EEPROMConfigure(EEPROMSize);
+
+        Rng rng(11);
+        static u8 expected[NumBlocks][Trace::DataSize];
+        memset(expected, 0xFF, sizeof(expected));
+        Latencies writes;
+        for (u32 i = 0; i < 12000; i++) {
+            u16 addr = rng.Next() % NumBlocks;
+            Fill(expected[addr], rng);
+            const u64 start = Flash::Sim::GetStats().cycles;
+            EEPROMWrite(addr, expected[addr], true);
+            writes.Add(Flash::Sim::GetStats().cycles - start);
+            Flash::Sim::Idle(FrameCycles);
+        }
+
+        Flash::Sim::PowerCycle();
+        ROMInit();
+        EEPROMConfigure(EEPROMSize);
+        u32 mismatches = 0;
+        for (u32 addr = 0; addr < NumBlocks; addr++) {
+            u8 data[Trace::DataSize];
+            EEPROMRead(addr, data);
+            mismatches += memcmp(data, expected[addr], Trace::DataSize) != 0;
+        }
+
+        // a save written without wait, e.g. from a game's save routine, a while after loading
+        Flash::Sim::Idle(300 * FrameCycles);
+        const u64 burstStart = Flash::Sim::GetStats().cycles;
+        for (u32 addr = 0; addr < 256; addr++) {
+            Fill(expected[addr], rng);
+            EEPROMWrite(addr, expected[addr], addr == 255);
+        }
+        const u64 burst = Flash::Sim::GetStats().cycles - burstStart;
+        Flash::Sim::PowerCycle();
+        ROMInit();
+        EEPROMConfigure(EEPROMSize);
+        for (u32 addr = 0; addr < 256; addr++) {
+            u8 data[Trace::DataSize];
+            EEPROMRead(addr, data);
+            mismatches += memcmp(data, expected[addr], Trace::DataSize) != 0;
+        }
+
+        const Flash::Sim::Stats &s = Flash::Sim::GetStats();
+        const bool failed = mismatches || s.rejected || s.violations;
+        printf("  %-14s write p50 %8.1f us  %3u sector erases  256 writes %8.1f ms  %s\n", c.name, Micros(writes.Percentile(50)), s.sectorErases, Micros(burst) / 1000,
+               failed ? "FAILED" : "ok");
+        ok = ok && !failed;
+    }
+    return ok;
+}
+
+bool Save(const std::string &dir, const NamedTrace &trace) {
+    std::string path = dir + "/" + trace.name + ".fptr";
+    FILE *f = fopen(path.c_str(), "wb");
+    if (f == nullptr) {
+        return false;
+    }
+    bool ok = fwrite(trace.bytes.data(), 1, trace.bytes.size(), f) == trace.bytes.size();
+    return fclose(f) == 0 && ok;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    std::vector<NamedTrace> traces;
+    const char *genDir = nullptr;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--gen") == 0 && i + 1 < argc) {
+            genDir = argv[++i];
+            continue;
+        }
+        if (strcmp(argv[i], "--ring") == 0 && i + 1 < argc) {
+            NamedTrace t;
+            if (!LoadRing(argv[++i], t)) {
+                fprintf(stderr, "no recorder ring in %s\n", argv[i]);
+                return 2;
+            }
+            traces.push_back(std::move(t));
+            continue;
+        }
+        NamedTrace t;
+        if (!Load(argv[i], t)) {
+            fprintf(stderr, "cannot read %s\n", argv[i]);
+            return 2;
+        }
+        traces.push_back(std::move(t));
+    }
+
+    int failed = 0;
+    if (genDir != nullptr || traces.empty()) {
+        std::vector<NamedTrace> synthetic = {FullSave(), FullResave(), HotSlot(), BurstSave(), BootReadAll(), PowerCycles(), Counters(), Flags(), Probes()};
+        if (genDir != nullptr) {
+            for (auto &t : synthetic) {
+                if (!Save(genDir, t)) {
+                    fprintf(stderr, "cannot write %s to %s\n", t.name.c_str(), genDir);
+                    return 2;
+                }
+            }
+            return 0;
+        }
+        traces = std::move(synthetic);
+        ScanKernel();
+        failed += !LegacyImage();
+        failed += !Recovery();
+        failed += !TornFrame();
+        failed += !Parts();
+        failed += !WaitStates();
+        failed += !Summaries();
+    }
+
+    for (auto &t : traces) {
+        Result r;
+        if (!Replay(t, r)) {
+            fprintf(stderr, "%s: malformed trace\n", t.name.c_str());
+            failed++;
+            continue;
+        }
+        Report(t.name.c_str(), r);
+        if (r.mismatches || r.protocolErrors || r.errors) {
+            failed++;
+        }
+    }
+
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,298 @@
+#pragma once
+
+#include <gba/flash_internal.h>
+#include <gba/gba.h>
+
+// Timer the background eraser arms while an erase is running, and Chip::Wait times programs and
+// erases with; -1 to leave all timers to the game.
+#ifndef FLASH_TIMER
+#define FLASH_TIMER 3
+#endif
+
+// IWRAM the flash access routines, the selected bank and the game's interrupt handler are kept in,
+// Cart::KernelRamBytes (204). The default ends 2.6 KB below the top of the user stack (0x03007F00),
+// which grows down towards it; move it if the game's stack or data reaches that far.
+#ifndef FLASH_KERNEL_RAM
+#define FLASH_KERNEL_RAM (IWRAM + 0x7400)
+#endif
+
+namespace Flash {
+
+// Backend for real hardware: the flash chip mapped at FLASH_BASE on the cartridge bus.
+// Flash::Chip and JFlash::Journal only ever touch the chip through a backend, so the
+// same code can run against Flash::Sim on the host.
+struct Cart {
+    Cart() = delete;
+
+    __attribute__((always_inline)) static u8 *Base() { return FLASH_BASE; }
+
+    // Top of the RAM area the journal keeps its bookkeeping in.
+    __attribute__((always_inline)) static uintptr_t WorkRamEnd() { return EWRAM + EWRAM_SIZE; }
+
+    __attribute__((always_inline)) static void SetWait(u16 wait) { REG_WAITCNT = (REG_WAITCNT & ~WAITCNT_SRAM_MASK) | wait; }
+    __attribute__((always_inline)) static u16 CurrentWait() { return REG_WAITCNT & WAITCNT_SRAM_MASK; }
+
+    __attribute__((always_inline)) static void Write(u8 *addr, u8 data) { *(vu8 *)addr = data; }
+
+    // Clears REG_IME and returns what it was, for RestoreIrq.
+    __attribute__((always_inline)) static u16 MaskIrq() {
+        const u16 ime = REG_IME;
+        REG_IME = 0;
+        return ime;
+    }
+
+    __attribute__((always_inline)) static void RestoreIrq(u16 ime) { REG_IME = ime; }
+
+    static u8 ReadStatus(const u8 *addr) {
+        ReadByteFunc read;
+        return read(const_cast<u8 *>(addr));
+    }
+
+    static constexpr int Timer = FLASH_TIMER;
+    static_assert(Timer >= -1 && Timer <= 3);
+
+    // [0] is the counter/reload register, [1] the control register
+    __attribute__((always_inline)) static vu16 *TimerReg() { return reinterpret_cast<vu16 *>(REG_ADDR_TMCNT + Timer * 4); }
+    static constexpr u16 TimerIrqFlag = Timer >= 0 ? INTR_FLAG_TIMER0 << Timer : 0;
+
+    static void StartTimer(u16 reload, u16 control) {
+        if constexpr (Timer >= 0) {
+            TimerReg()[1] = 0;
+            TimerReg()[0] = reload;
+            TimerReg()[1] = control;
+        }
+    }
+
+    static u16 TimerCount() {
+        if constexpr (Timer >= 0) {
+            return TimerReg()[0];
+        }
+        return 0;
+    }
+
+    static void StopTimer() {
+        if constexpr (Timer >= 0) {
+            TimerReg()[1] = 0;
+        }
+    }
+
+    // Acknowledges the timer's interrupt if it is pending, also towards IntrWait.
+    static bool TakeTimerIrq() {
+        if constexpr (Timer >= 0) {
+            if (REG_IF & TimerIrqFlag) {
+                REG_IF = TimerIrqFlag;
+                INTR_CHECK |= TimerIrqFlag;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Left pending for the game's own handler to acknowledge.
+    static bool VBlankPending() { return (REG_IF & INTR_FLAG_VBLANK) != 0; }
+
+    // Calls fn from the interrupt handler in system mode, so it runs on the game's stack rather than
+    // the BIOS's 160-byte IRQ stack. Interrupts stay masked. The patch is built for ARM state.
+    static void OnUserStack(void (*fn)()) {
+        register void (*target)() asm("r0") = fn;
+        asm volatile("mrs r2, cpsr\n"
+                     "orr r3, r2, #0x1f\n"
+                     "msr cpsr_c, r3\n"
+                     "push {r2, lr}\n"
+                     "mov lr, pc\n"
+                     "bx r0\n"
+                     "pop {r2, lr}\n"
+                     "msr cpsr_c, r2\n"
+                     : "+r"(target)
+                     :
+                     : "r1", "r2", "r3", "r12", "memory", "cc");
+    }
+
+    // Puts handler in front of the game's interrupt handler, which is kept in ChainedIrq; handler has
+    // to call it. Games may install their own handler again later, so this is safe to repeat. Only
+    // after Install, which forgets the game's handler whenever it has to copy the routines.
+    static void HookIrq(void (*handler)()) {
+        if constexpr (Timer >= 0) {
+            if (INTR_VECTOR != reinterpret_cast<void *>(handler)) {
+                *ChainedIrq() = reinterpret_cast<void (*)()>(INTR_VECTOR);
+                INTR_VECTOR = reinterpret_cast<void *>(handler);
+            }
+            REG_IE = REG_IE | TimerIrqFlag;
+        }
+    }
+
+    // Flash can't be read by code running from ROM, so reads go through small ARM routines that
+    // Install copies to FLASH_KERNEL_RAM once, where they also run off the fast 32-bit bus.
+    struct ReadByteFunc {
+        u8 operator()(u8 *addr) const { return Kernel<ReadByteKernel>(ReadByteEntry)(addr); }
+    };
+
+    struct ReadCoreFunc {
+        void operator()(u8 *src, u8 *dest, u32 size) const { Kernel<ReadCoreKernel>(ReadCoreEntry)(src, dest, size); }
+    };
+
+    // Reads addr until it returns lastData, at most tries times; false if it never did.
+    static bool Poll(u8 *addr, u8 lastData, u32 tries) { return Kernel<PollKernel>(PollEntry)(addr, lastData, tries) == 0; }
+
+    // See Chip::Scan.
+    static u32 Scan(const u8 *field, u8 stride, u32 count, u16 target, u16 *out, u16 shortFlag, u8 shortStride) {
+        return Kernel<ScanKernel>(ScanEntry)(field, count, target | (u32)stride << 16 | (u32)shortStride << 24, out, shortFlag);
+    }
+
+    // Whether size bytes from addr all read 0xFF; stops at the first one that doesn't.
+    static bool Blank(const u8 *addr, u32 size) { return Kernel<BlankKernel>(BlankEntry)(addr, size) != 0; }
+
+    // Bank last selected on a 1M part, 0xFF when unknown. Kept after the routines, so it is
+    // forgotten whenever Install has to copy them again.
+    __attribute__((always_inline)) static u8 *BankCache() { return reinterpret_cast<u8 *>(FLASH_KERNEL_RAM + KernelWords * 4); }
+
+    // Read wait found by Chip::CalibrateWait, 0xFF if none; kept and forgotten like the bank.
+    __attribute__((always_inline)) static u8 *ReadWaitCache() { return BankCache() + 1; }
+
+    // Interrupt handler HookIrq put one in front of, nullptr if none; kept and forgotten like the bank.
+    __attribute__((always_inline)) static void (**ChainedIrq())() { return reinterpret_cast<void (**)()>(FLASH_KERNEL_RAM + KernelWords * 4 + 4); }
+
+    // Copies the routines unless they are already in place. The game owns that RAM and may clear it
+    // after boot, so this is repeated before the chip is used.
+    static void Install() {
+        u32 *code = reinterpret_cast<u32 *>(FLASH_KERNEL_RAM);
+        if (code[0] == 0xe5d00000 && code[PollEntry] == 0xe5d03000 && code[ScanEntry] == 0xe92d01f0 && code[BlankEntry] == 0xe4d02001 && code[KernelWords - 1] == 0xe12fff1e) {
+            return;
+        }
+
+        // ReadByteEntry:
+        //   ldrb    r0, [r0]
+        //   bx      lr
+        code[0] = 0xe5d00000;
+        code[1] = 0xe12fff1e;
+        // ReadCoreEntry:
+        //   subs    r2, r2, #1
+        //   ldrbhs  r3, [r0], #1
+        //   strbhs  r3, [r1], #1
+        //   bhs     ReadCoreEntry
+        //   bx      lr
+        code[2] = 0xe2522001;
+        code[3] = 0x24d03001;
+        code[4] = 0x24c13001;
+        code[5] = 0x2afffffb;
+        code[6] = 0xe12fff1e;
+        // PollEntry:
+        //   ldrb    r3, [r0]
+        //   cmp     r3, r1
+        //   moveq   r0, #0
+        //   bxeq    lr
+        //   subs    r2, r2, #1
+        //   bne     PollEntry
+        //   mov     r0, #1
+        //   bx      lr
+        code[7] = 0xe5d03000;
+        code[8] = 0xe1530001;
+        code[9] = 0x03a00000;
+        code[10] = 0x012fff1e;
+        code[11] = 0xe2522001;
+        code[12] = 0x1afffff9;
+        code[13] = 0xe3a00001;
+        code[14] = 0xe12fff1e;
+        // ScanEntry:
+        //   push    {r4, r5, r6, r7, r8}
+        //   ldr     r7, [sp, #20]
+        //   mov     r4, #0
+        //   lsr     r5, r2, #16
+        //   and     r5, r5, #255
+        //   lsr     r8, r2, #24
+        //   lsl     r2, r2, #16
+        //   lsr     r2, r2, #16
+        // loop:
+        //   cmp     r4, r1
+        //   beq     done
+        //   ldrb    r6, [r0]
+        //   ldrb    r12, [r0, #1]
+        //   orr     r6, r6, r12, lsl #8
+        //   cmp     r3, #0
+        //   strhne  r6, [r3], #2
+        //   cmp     r6, r2
+        //   beq     done
+        //   tst     r6, r7
+        //   addne   r0, r0, r8
+        //   addeq   r0, r0, r5
+        //   add     r4, r4, #1
+        //   b       loop
+        // done:
+        //   mov     r0, r4
+        //   pop     {r4, r5, r6, r7, r8}
+        //   bx      lr
+        code[15] = 0xe92d01f0;
+        code[16] = 0xe59d7014;
+        code[17] = 0xe3a04000;
+        code[18] = 0xe1a05822;
+        code[19] = 0xe20550ff;
+        code[20] = 0xe1a08c22;
+        code[21] = 0xe1a02802;
+        code[22] = 0xe1a02822;
+        code[23] = 0xe1540001;
+        code[24] = 0x0a00000b;
+        code[25] = 0xe5d06000;
+        code[26] = 0xe5d0c001;
+        code[27] = 0xe186640c;
+        code[28] = 0xe3530000;
+        code[29] = 0x10c360b2;
+        code[30] = 0xe1560002;
+        code[31] = 0x0a000004;
+        code[32] = 0xe1160007;
+        code[33] = 0x10800008;
+        code[34] = 0x00800005;
+        code[35] = 0xe2844001;
+        code[36] = 0xeafffff1;
+        code[37] = 0xe1a00004;
+        code[38] = 0xe8bd01f0;
+        code[39] = 0xe12fff1e;
+        // BlankEntry:
+        //   ldrb    r2, [r0], #1
+        //   cmp     r2, #255
+        //   bne     dirty
+        //   subs    r1, r1, #1
+        //   bne     BlankEntry
+        //   mov     r0, #1
+        //   bx      lr
+        // dirty:
+        //   mov     r0, #0
+        //   bx      lr
+        code[40] = 0xe4d02001;
+        code[41] = 0xe35200ff;
+        code[42] = 0x1a000003;
+        code[43] = 0xe2511001;
+        code[44] = 0x1afffffa;
+        code[45] = 0xe3a00001;
+        code[46] = 0xe12fff1e;
+        code[47] = 0xe3a00000;
+        code[48] = 0xe12fff1e;
+
+        *BankCache() = 0xFF;
+        *ReadWaitCache() = 0xFF;
+        *ChainedIrq() = nullptr;
+    }
+
+  private:
+    using ReadByteKernel = u8 (*)(u8 *addr);
+    using ReadCoreKernel = void (*)(u8 *src, u8 *dest, u32 size);
+    using PollKernel = u32 (*)(u8 *addr, u32 lastData, u32 tries);
+    using BlankKernel = u32 (*)(const u8 *addr, u32 size);
+    using ScanKernel = u32 (*)(const u8 *field, u32 count, u32 targetAndStrides, u16 *out, u32 shortFlag);
+
+    // word offsets into FLASH_KERNEL_RAM
+    static constexpr int ReadByteEntry = 0;
+    static constexpr int ReadCoreEntry = 2;
+    static constexpr int PollEntry = 7;
+    static constexpr int ScanEntry = 15;
+    static constexpr int BlankEntry = 40;
+    static constexpr int KernelWords = 49;
+
+    template <class Fn> __attribute__((always_inline)) static Fn Kernel(int entry) { return reinterpret_cast<Fn>(FLASH_KERNEL_RAM + entry * 4); }
+
+  public:
+    // The routines, the bank and read wait bytes, two bytes of padding and the chained handler.
+    static constexpr u32 KernelRamBytes = KernelWords * 4 + 8;
+    static_assert(KernelRamBytes == 204);
+};
+
+} // namespace Flash
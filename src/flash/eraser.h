@@ -0,0 +1,189 @@
+#pragma once
+
+#include <flash/flash.h>
+
+namespace Flash {
+
+/*
+    Erases a queue of sectors in the background, highest sector first.
+
+    An erase is only started (EraseSector without wait) and the backend's timer is armed with
+    the part's sector erase setup from maxTime. Every timer interrupt polls DQ7 of the sector
+    being erased, and once it reads back erased, the next queued sector is started. A sector
+    still erasing after maxTime ticks is reported in failed and goes back into the queue; the
+    queue stops there, so lower sectors (and a header in them) are never erased past it.
+    Sectors that already read blank are dropped from the queue without an erase. Parts that
+    program a page at a time have no sector erase, their sectors are erased one page per erase,
+    from the last page down.
+
+    The chips have no erase suspend: while a sector erases, no other part of the chip can be
+    read or programmed. Code using the chip does so between Acquire and Release. Acquire only
+    waits for the sector in flight, not for the rest of the queue, and keeps the interrupt off
+    the chip; Release starts the next sector. Without a timer the queue only moves on there.
+
+    State lives in RAM provided by the caller, the patch has no data section.
+*/
+template <class Chip, class Backend> class Eraser {
+  public:
+    static constexpr u8 NoSector = 0xFF;
+
+    struct State {
+        // Sectors waiting to be erased, bit n for sector n.
+        u32 pending;
+        // Sectors whose erase timed out.
+        u32 failed;
+        // Timer ticks left for the erase in flight.
+        u16 ticks;
+        // Sector being erased, NoSector if none.
+        u8 current;
+        // Page of it being erased, see Chip::ErasePage.
+        u8 page;
+        // Set between Acquire and Release.
+        u8 held;
+    };
+
+    static_assert(Chip::Info.type.sector.count <= 32);
+
+  private:
+    // maxTime holds {ticks, reload, control} per phase; phase 2 is the sector erase.
+    static constexpr const u16 *EraseTime = Chip::Info.maxTime + 2 * 3;
+
+    static void Fail(State &s) {
+        s.failed |= 1u << s.current;
+        s.pending |= 1u << s.current;
+        Backend::StopTimer();
+    }
+
+    static void StartNext(State &s) {
+        if (s.pending == 0 || s.failed != 0) {
+            Backend::StopTimer();
+            return;
+        }
+
+        u8 sector = 31;
+        while (!(s.pending & (1u << sector))) {
+            sector--;
+        }
+        s.pending &= ~(1u << sector);
+
+        // a blank sector, e.g. one the journal never reached, is only checked; the next one waits
+        // for the next tick, so a run of them doesn't hold up the interrupt
+        if (Chip::SectorBlank(sector)) {
+            Backend::StartTimer(EraseTime[1], EraseTime[2]);
+            return;
+        }
+
+        Chip::EraseSector(sector, false);
+        s.current = sector;
+        s.page = Chip::PagesPerSector - 1;
+        s.ticks = EraseTime[0];
+        Backend::StartTimer(EraseTime[1], EraseTime[2]);
+    }
+
+  public:
+    Eraser() = delete;
+
+    // Forgets the queue once the chip is idle, or was reset after a chip erase's maxTime.
+    static void Reset(State &s) {
+        s.held = 1;
+        Backend::StopTimer();
+        Chip::WaitIdle();
+        s.pending = 0;
+        s.failed = 0;
+        s.current = NoSector;
+        s.held = 0;
+    }
+
+    static void Queue(State &s, u32 sectors) { s.pending |= sectors; }
+
+    static bool Idle(const State &s) { return s.pending == 0 && s.current == NoSector; }
+
+    // Clears failed so Release retries those sectors; returns whether there were any.
+    static bool TakeFailure(State &s) {
+        bool failed = s.failed != 0;
+        s.failed = 0;
+        return failed;
+    }
+
+    // Starts erasing the page below the one just erased; false if that was the sector's first.
+    static bool NextPage(State &s) {
+        if (s.page == 0) {
+            return false;
+        }
+        Chip::ErasePage(s.current, --s.page);
+        return true;
+    }
+
+    // Waits for the erase in flight, the rest of its sector included.
+    static void Settle(State &s) {
+        if (s.current == NoSector) {
+            return;
+        }
+
+        do {
+            if (Chip::Wait(2, Chip::ErasePollAddress(s.current, s.page), 0xFF) != 0) {
+                Fail(s);
+                break;
+            }
+        } while (NextPage(s));
+        s.current = NoSector;
+    }
+
+    static void Acquire(State &s) {
+        s.held = 1;
+        Settle(s);
+    }
+
+    static void Release(State &s) {
+        if (s.current == NoSector) {
+            StartNext(s);
+        }
+        s.held = 0;
+    }
+
+    // Like Acquire and Release for code that doesn't touch the chip: the erase in flight goes on,
+    // only Tick stays away until Resume.
+    static void Pause(State &s) { s.held = 1; }
+    static void Resume(State &s) { s.held = 0; }
+
+    // Erases everything queued before returning; only between Acquire and Release.
+    static u16 Finish(State &s) {
+        Settle(s);
+        while (s.pending != 0 && s.failed == 0) {
+            StartNext(s);
+            Settle(s);
+        }
+        Backend::StopTimer();
+        return s.failed != 0 ? 0xA000 : 0;
+    }
+
+    // Called from the timer interrupt.
+    static void Tick(State &s) {
+        if (s.held) {
+            return;
+        }
+        if (s.current == NoSector) {
+            StartNext(s);
+            return;
+        }
+
+        if (Chip::Busy(Chip::ErasePollAddress(s.current, s.page))) {
+            if (--s.ticks != 0) {
+                return;
+            }
+            Fail(s);
+            s.current = NoSector;
+            return;
+        }
+
+        if (NextPage(s)) {
+            s.ticks = EraseTime[0];
+            return;
+        }
+
+        s.current = NoSector;
+        StartNext(s);
+    }
+};
+
+} // namespace Flash
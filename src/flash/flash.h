@@ -4,6 +4,7 @@
     Inspired from the Pokeruby decompilation project
 */
 
+#include <flash/cart.h>
 #include <gba/flash_internal.h>
 #include <gba/gba.h>
 
@@ -13,235 +14,567 @@ constexpr u16 mxMaxTime[] = {
     2000, 65469, TIMER_ENABLE | TIMER_INTR_ENABLE | TIMER_256CLK, 2000, 65469, TIMER_ENABLE | TIMER_INTR_ENABLE | TIMER_256CLK,
 };
 
+constexpr u16 atMaxTime[] = {
+    10, 65469, TIMER_ENABLE | TIMER_INTR_ENABLE | TIMER_256CLK, 10, 65469, TIMER_ENABLE | TIMER_INTR_ENABLE | TIMER_256CLK,
+    40, 65469, TIMER_ENABLE | TIMER_INTR_ENABLE | TIMER_256CLK, 40, 65469, TIMER_ENABLE | TIMER_INTR_ENABLE | TIMER_256CLK,
+};
+
 using Type = FlashType;
 
+// Typical operation times from the part's datasheet, in microseconds.
+struct Timing {
+    const u32 program;
+    const u32 eraseSector;
+    const u32 eraseChip;
+};
+
 struct Info {
     const u16 *const maxTime;
+    // Nintendo's FlashType. Programs and erases run at type.wait[0]; type.wait[1] isn't used. Reads
+    // run at 8 wait states unless Chip::CalibrateWait found a faster wait for the chip on the cart,
+    // the only per-chip read wait there is.
     const Type type;
+    const Timing timing;
+    // Takes the unlock bypass command (0x20): once in it, a byte is programmed with 0xA0 and the
+    // data alone instead of the three-cycle unlock sequence.
+    const bool unlockBypass = false;
+    // Bytes loaded by one program command, 0 if the part programs a byte at a time. Such a part
+    // erases and programs a whole page in one go, and has no sector erase.
+    const u16 page = 0;
 };
 
 constexpr Info MX29L010 = {.maxTime = mxMaxTime,
-                           .type = {
-                               .romSize = 131072,
-                               .sector =
-                                   {
-                                       .size = 4096,
-                                       .shift = 12,
-                                       .count = 32,
-                                       .top = 0,
-                                   },
-                           }};
+                           .type =
+                               {
+                                   .romSize = 131072,
+                                   .sector =
+                                       {
+                                           .size = 4096,
+                                           .shift = 12,
+                                           .count = 32,
+                                           .top = 0,
+                                       },
+                                   .wait = {3, 1},
+                                   .ids = {.separate = {.makerID = 0xC2, .deviceID = 0x09}},
+                               },
+                           .timing =
+                               {
+                                   .program = 30,
+                                   .eraseSector = 60000,
+                                   .eraseChip = 1000000,
+                               },
+                           .unlockBypass = true};
 
 constexpr Info SST39SF512 = {.maxTime = mxMaxTime,
                              .type = {.romSize = 64 * 1024,
-                                      .sector = {
-                                          .size = 4096,
-                                          .shift = 12,
-                                          .count = 16,
-                                          .top = 0,
-                                      }}};
-
-template <const Info &F = SST39SF512> class Chip {
+                                      .sector =
+                                          {
+                                              .size = 4096,
+                                              .shift = 12,
+                                              .count = 16,
+                                              .top = 0,
+                                          },
+                                      .wait = {3, 1},
+                                      .ids = {.separate = {.makerID = 0xBF, .deviceID = 0xB4}}},
+                             .timing = {
+                                 .program = 14,
+                                 .eraseSector = 18000,
+                                 .eraseChip = 70000,
+                             }};
+
+// The parts found on GBA carts, with the IDs they report and the access times they need.
+constexpr Info SST39VF512 = {.maxTime = mxMaxTime,
+                             .type = {.romSize = 64 * 1024,
+                                      .sector = {.size = 4096, .shift = 12, .count = 16, .top = 0},
+                                      .wait = {3, 1},
+                                      .ids = {.separate = {.makerID = 0xBF, .deviceID = 0xD4}}},
+                             .timing = {.program = 14, .eraseSector = 18000, .eraseChip = 70000}};
+
+constexpr Info MX29L512 = {.maxTime = mxMaxTime,
+                           .type = {.romSize = 64 * 1024,
+                                    .sector = {.size = 4096, .shift = 12, .count = 16, .top = 0},
+                                    .wait = {3, 1},
+                                    .ids = {.separate = {.makerID = 0xC2, .deviceID = 0x1C}}},
+                           .timing = {.program = 30, .eraseSector = 60000, .eraseChip = 1000000},
+                           .unlockBypass = true};
+
+constexpr Info MN63F805MNP = {.maxTime = mxMaxTime,
+                              .type = {.romSize = 64 * 1024,
+                                       .sector = {.size = 4096, .shift = 12, .count = 16, .top = 0},
+                                       .wait = {0, 3},
+                                       .ids = {.separate = {.makerID = 0x32, .deviceID = 0x1B}}},
+                              .timing = {.program = 30, .eraseSector = 50000, .eraseChip = 500000}};
+
+constexpr Info LE26FV10N1TS = {.maxTime = mxMaxTime,
+                               .type = {.romSize = 128 * 1024,
+                                        .sector = {.size = 4096, .shift = 12, .count = 32, .top = 0},
+                                        .wait = {3, 1},
+                                        .ids = {.separate = {.makerID = 0x62, .deviceID = 0x13}}},
+                               .timing = {.program = 30, .eraseSector = 40000, .eraseChip = 400000}};
+
+// No sector erase: a 128-byte page is erased and programmed in one go. Sectors are 4 KB like on
+// the other parts and are erased page by page.
+constexpr Info AT29LV512 = {.maxTime = atMaxTime,
+                            .type = {.romSize = 64 * 1024,
+                                     .sector = {.size = 4096, .shift = 12, .count = 16, .top = 0},
+                                     .wait = {3, 1},
+                                     .ids = {.separate = {.makerID = 0x1F, .deviceID = 0x3D}}},
+                            .timing = {.program = 10000, .eraseSector = 10000, .eraseChip = 20000},
+                            .page = 128};
+
+template <const Info &F = SST39SF512, class Backend = Cart> class Chip {
   private:
-    // Never actually used.
-    __attribute__((noinline, target("thumb-mode"))) static u8 ReadByteCore(u8 *addr) { return *addr; }
+    __attribute__((always_inline)) static void Command(u16 addr, u8 data) { Backend::Write(Backend::Base() + addr, data); }
+
+    // Polls about as many times as fit in the maxTime of phase, for backends without a timer.
+    static constexpr u32 Tries(u8 phase) {
+        constexpr u8 pollCycles = 16;
+        constexpr u16 prescaler[] = {1, 64, 256, 1024};
+        const u16 *const time = F.maxTime + phase * 3;
+        return time[0] * (0x10000 - time[1]) * prescaler[time[2] & 3] / pollCycles;
+    }
+
+    // Calls done until it returns true, for at most the maxTime of phase; false if it never did.
+    template <class Done> static bool Until(u8 phase, Done done) {
+        if constexpr (Backend::Timer < 0) {
+            for (u32 tries = Tries(phase); tries != 0; tries--) {
+                if (done()) {
+                    return true;
+                }
+            }
+            return false;
+        }
 
-    __attribute__((noinline, target("thumb-mode"))) static void ReadFlashCore(u8 *src, u8 *dest, u32 size) {
-        while (size-- != 0) {
-            *dest++ = *src++;
+        // the eraser's timer, free while the chip is in use; counted without its interrupt
+        const u16 *const time = F.maxTime + phase * 3;
+        Backend::StartTimer(time[1], time[2] & ~TIMER_INTR_ENABLE);
+        bool result = false;
+        u16 last = Backend::TimerCount();
+        for (u16 ticks = 0; ticks < time[0];) {
+            if (done()) {
+                result = true;
+                break;
+            }
+
+            const u16 now = Backend::TimerCount();
+            ticks += now < last;
+            last = now;
         }
+        Backend::StopTimer();
+        return result;
     }
 
   public:
     Chip() = delete;
 
     static constexpr auto Info = F;
+    static constexpr u32 BankSize = SECTORS_PER_BANK << F.type.sector.shift;
+    static constexpr u16 PagesPerSector = F.page != 0 ? F.type.sector.size / F.page : 1;
+    static_assert(F.page == 0 || F.type.sector.size % F.page == 0);
+
+    using ReadByteFunc = typename Backend::ReadByteFunc;
+    using ReadCoreFunc = typename Backend::ReadCoreFunc;
+
+    __attribute__((always_inline)) static u8 *Base() { return Backend::Base(); }
+
+    // 1M parts show one 64 KB bank at a time at Base(). The backend caches the bank last selected,
+    // so the chip is only told when it changes.
+    static void SwitchBank(u8 bank) {
+        if constexpr (F.type.romSize == FLASH_ROM_SIZE_1M) {
+            u8 *cached = Backend::BankCache();
+            if (*cached == bank) {
+                return;
+            }
+
+            Backend::SetWait(F.type.wait[0]);
+            Command(0x5555, 0xAA);
+            Command(0x2AAA, 0x55);
+            Command(0x5555, 0xB0);
+            Backend::Write(Base(), bank);
+            *cached = bank;
+            Backend::SetWait(ReadWait());
+        }
+    }
 
-    static void SwitchBank(u16 sectorNum) {
-        // not supported yet
-        return;
+    // Addresses passed to Chip span the whole part as if it was mapped flat from Base(); Window
+    // turns one into where it shows up in its bank, Map also selects that bank.
+    __attribute__((always_inline)) static u8 *Window(const u8 *addr) {
+        if constexpr (F.type.romSize == FLASH_ROM_SIZE_1M) {
+            return Base() + ((addr - Base()) & (BankSize - 1));
+        }
+        return const_cast<u8 *>(addr);
     }
 
-    static void Init() {
-        REG_WAITCNT = (REG_WAITCNT & ~WAITCNT_SRAM_MASK) | WAITCNT_SRAM_8;
-        FLASH_WRITE(0x5555, 0xAA);
-        FLASH_WRITE(0x2AAA, 0x55);
-        FLASH_WRITE(0x5555, 0x90);
+    static u8 *Map(const u8 *addr) {
+        if constexpr (F.type.romSize == FLASH_ROM_SIZE_1M) {
+            SwitchBank((addr - Base()) / BankSize);
+        }
+        return Window(addr);
+    }
 
-        FLASH_WRITE(0x5555, 0xAA);
-        FLASH_WRITE(0x2AAA, 0x55);
-        FLASH_WRITE(0x5555, 0xF0);
+    __attribute__((always_inline)) static u8 *SectorAddress(u16 sectorNum) { return Base() + (sectorNum << F.type.sector.shift); }
+    __attribute__((always_inline)) static u8 *PageAddress(u16 sectorNum, u16 page) { return SectorAddress(sectorNum) + page * F.page; }
+
+    // Where DQ7 of an erase is polled: a page is only polled at the last byte loaded into it.
+    __attribute__((always_inline)) static u8 *ErasePollAddress(u16 sectorNum, u16 page = 0) {
+        return PageAddress(sectorNum, page) + (F.page != 0 ? F.page - 1 : 0);
     }
 
-    struct ReadByteFunc {
-      private:
-        u16 Code[2];
+    // Puts the backend's flash access routines in place and sets up the read wait; the journal
+    // repeats it before each use, the game may have changed either.
+    static void Install() {
+        Backend::Install();
+        Backend::SetWait(ReadWait());
+    }
 
-      public:
-        ReadByteFunc() {
-            // ldrb r0, [r0]
-            // bx lr
-            Code[0] = 0x7800;
-            Code[1] = 0x4770;
+    // SRAM wait reads are done with: the one CalibrateWait found, or else 8 wait states, which
+    // Nintendo's library always reads at. Programs and erases switch to wait[0] and back.
+    __attribute__((always_inline)) static u16 ReadWait() {
+        const u8 calibrated = *Backend::ReadWaitCache();
+        return calibrated != 0xFF ? calibrated : WAITCNT_SRAM_8;
+    }
+
+    static constexpr u8 CalibrationBytes = 64;
+
+    // Looks for the fastest wait at which size bytes from addr read back the same as with 8 wait
+    // states, a few times over, and keeps it as the read wait. addr should hold data with both
+    // values of each bit; false, leaving the read wait alone, if it is all 0xFF.
+    static bool CalibrateWait(const void *addr, u8 size = CalibrationBytes) {
+        u8 *src = Map(reinterpret_cast<const u8 *>(addr));
+        ReadCoreFunc readFlashCore;
+        u8 reference[CalibrationBytes];
+        u8 check[CalibrationBytes];
+        size = size < CalibrationBytes ? size : CalibrationBytes;
+
+        Backend::SetWait(WAITCNT_SRAM_8);
+        readFlashCore(src, reference, size);
+        u8 all = 0xFF;
+        for (u8 i = 0; i < size; i++) {
+            all &= reference[i];
+        }
+        if (all == 0xFF) {
+            Backend::SetWait(ReadWait());
+            return false;
         }
 
-        u8 operator()(u8 *addr) {
-            auto func = decltype(&ReadByteCore)((uintptr_t)Code + 1);
-            return func(addr);
+        // fastest first: 2, 3, then 4 wait states
+        u16 found = WAITCNT_SRAM_8;
+        for (u16 wait = WAITCNT_SRAM_2; wait != WAITCNT_SRAM_8 && found == WAITCNT_SRAM_8; wait = (wait - 1) & WAITCNT_SRAM_MASK) {
+            Backend::SetWait(wait);
+            bool stable = true;
+            for (int pass = 0; pass < 4 && stable; pass++) {
+                readFlashCore(src, check, size);
+                for (u8 i = 0; i < size; i++) {
+                    stable = stable && check[i] == reference[i];
+                }
+            }
+            if (stable) {
+                found = wait;
+            }
         }
-    };
 
+        *Backend::ReadWaitCache() = found;
+        Backend::SetWait(found);
+        return true;
+    }
+
+    static void Init() { ReadIds(); }
+
+    // Maker ID in the low byte and device ID in the high one, as in Type::ids.joined. A program
+    // or erase still running, e.g. from before a soft reset, is waited for first, see WaitIdle.
+    static u16 ReadIds() {
+        Install();
+        // the part, and so its read wait, isn't known yet
+        Backend::SetWait(WAITCNT_SRAM_8);
+        WaitIdle();
+
+        Command(0x5555, 0xAA);
+        Command(0x2AAA, 0x55);
+        Command(0x5555, 0x90);
+
+        ReadByteFunc read;
+        u16 ids = read(Base()) | read(Base() + 1) << 8;
+
+        Command(0x5555, 0xAA);
+        Command(0x2AAA, 0x55);
+        Command(0x5555, 0xF0);
+        return ids;
+    }
+
+    // Waits until the program or erase of a maxTime phase (1 program, 2 sector erase, 3 chip erase)
+    // is done, i.e. addr reads lastData and DQ6 stopped toggling, in the bank selected when it
+    // started. 0xA000 if it takes longer than maxTime, counted on the backend's timer; without one
+    // the routine polling the chip tries about as many times as fit in that time.
     static u16 Wait(u8 phase, u8 *addr, u8 lastData) {
-        u16 result = 0;
-        u16 delay = 2000;
-        ReadByteFunc readFlashByte;
+        u8 *status = Window(addr);
 
-        while (readFlashByte(addr) != lastData) {
-            if (delay == 0) {
-                result = 0xA000;
-                break;
+        if constexpr (Backend::Timer < 0) {
+            return Backend::Poll(status, lastData, Tries(phase)) ? 0 : 0xA000;
+        }
+
+        // DQ7 can flip before the other bits settle, and the same value twice means DQ6 is still
+        return Until(phase, [&] { return Backend::ReadStatus(status) == lastData && Backend::ReadStatus(status) == lastData; }) ? 0 : 0xA000;
+    }
+
+    // Waits for a program or erase whose data isn't known, e.g. one left running from before a soft
+    // reset, for at most a chip erase's maxTime. A chip still busy then is sent the reset command
+    // (0xF0); 0xA000 in that case.
+    static u16 WaitIdle() {
+        if (Until(3, [] { return !Toggling(Base()); })) {
+            return 0;
+        }
+        Backend::Write(Base(), 0xF0);
+        return 0xA000;
+    }
+
+    // DQ7 data polling: while a program or erase is running, DQ7 of any read reads back
+    // inverted from lastData, the value that is being written (0xFF for an erase).
+    static bool Busy(u8 *addr, u8 lastData = 0xFF) { return ((Backend::ReadStatus(Window(addr)) ^ lastData) & 0x80) != 0; }
+
+    // DQ6 toggles on every read while a program or erase is running, whatever the address.
+    static bool Toggling(u8 *addr) { return ((Backend::ReadStatus(Window(addr)) ^ Backend::ReadStatus(Window(addr))) & 0x40) != 0; }
+
+    // Walks count records of stride bytes, field being the address of a u16 in the first one. Every
+    // value passed is copied to out unless it is null, and the walk stops at the first one equal to
+    // target. Returns the index of that record, count if there is none. Records whose value has
+    // a bit of shortFlag set are shortStride bytes long instead.
+    static u32 Scan(const u8 *field, u8 stride, u32 count, u16 target, u16 *out = nullptr, u16 shortFlag = 0, u8 shortStride = 0) {
+        field = Map(field);
+        return Backend::Scan(field, stride, count, target, out, shortFlag, shortStride);
+    }
+
+    // Like Scan, but returns the last record equal to target, count if there is none.
+    static u32 ScanLast(const u8 *field, u8 stride, u32 count, u16 target, u16 *out = nullptr) {
+        u32 last = count;
+        for (u32 i = 0; i < count; i++) {
+            i += Scan(field + i * stride, stride, count - i, target, out != nullptr ? out + i : nullptr);
+            if (i < count) {
+                last = i;
             }
-            delay--;
         }
+        return last;
+    }
 
-        return result;
+    // Whether a sector reads all 0xFF, i.e. needs no erase. Stops at the first byte that doesn't.
+    static bool SectorBlank(u16 sectorNum) {
+        u8 *addr = Map(SectorAddress(sectorNum));
+        return Backend::Blank(addr, F.type.sector.size);
     }
 
     static u8 ReadByte(u8 *addr) {
+        addr = Map(addr);
         ReadByteFunc buf;
         return buf(addr);
     }
 
-    struct ReadCoreFunc {
-        u16 Code[9];
-
-        ReadCoreFunc() {
-            /*
-            000000e0  002a       cmp     r2, #0
-            000000e2  05d0       beq     #0xf0
-
-            000000e4  0378       ldrb    r3, [r0]
-            000000e6  0b70       strb    r3, [r1]
-            000000e8  491c       adds    r1, r1, #1
-            000000ea  401c       adds    r0, r0, #1
-            000000ec  521e       subs    r2, r2, #1
-            000000ee  f9d1       bne     #0xe4
-
-            000000f0  7047       bx      lr
-            */
-            Code[0] = 0x2a00;
-            Code[1] = 0xd005;
-            Code[2] = 0x7803;
-            Code[3] = 0x700b;
-            Code[4] = 0x1c49;
-            Code[5] = 0x1c40;
-            Code[6] = 0x1e52;
-            Code[7] = 0xd1f9;
-            Code[8] = 0x4770;
-        }
-
-        void operator()(u8 *dest, u8 *src, u32 size) const {
-            auto func = decltype(&ReadFlashCore)((uintptr_t)Code + 1);
-            return func(dest, src, size);
-        }
-    };
-
     static void ReadSector(u16 sectorNum, u32 offset, u8 *dest, u32 size) {
         u8 *src;
         ReadCoreFunc readFlashCore;
 
-        REG_WAITCNT = (REG_WAITCNT & ~WAITCNT_SRAM_MASK) | WAITCNT_SRAM_8;
-
-        if (F.type.romSize == FLASH_ROM_SIZE_1M) {
-            SwitchBank(sectorNum / SECTORS_PER_BANK);
-            sectorNum %= SECTORS_PER_BANK;
-        }
-
-        src = FLASH_BASE + (sectorNum << F.type.sector.shift) + offset;
+        src = Map(SectorAddress(sectorNum) + offset);
 
-        readFlashCore(dest, src, size);
+        readFlashCore(src, dest, size);
     }
 
+    // src must not cross into another bank.
     static void ReadMem(u8 *dest, u8 *src, u32 size) {
         ReadCoreFunc readFlashCore;
 
-        REG_WAITCNT = (REG_WAITCNT & ~WAITCNT_SRAM_MASK) | WAITCNT_SRAM_8;
+        src = Map(src);
 
-        if (F.type.romSize == FLASH_ROM_SIZE_1M) {
-            // determine sectorNum from src
-            // SwitchBank(sectorNum / SECTORS_PER_BANK);
-            // sectorNum %= SECTORS_PER_BANK;
-        }
-
-        readFlashCore(dest, src, size);
+        readFlashCore(src, dest, size);
     }
 
+    // Parts that program a page at a time always wait.
     static u16 WriteByte(u8 *dest, u8 *src, bool wait = true) {
-        REG_WAITCNT = (REG_WAITCNT & ~WAITCNT_SRAM_MASK) | F.type.wait[0];
+        if constexpr (F.page != 0) {
+            return Program(dest, src, 1);
+        }
+
+        dest = Map(dest);
+        Backend::SetWait(F.type.wait[0]);
 
-        FLASH_WRITE(0x5555, 0xAA);
-        FLASH_WRITE(0x2AAA, 0x55);
-        FLASH_WRITE(0x5555, 0xA0);
-        *dest = *src;
+        Command(0x5555, 0xAA);
+        Command(0x2AAA, 0x55);
+        Command(0x5555, 0xA0);
+        Backend::Write(dest, *src);
 
         u16 result = 0;
         if (wait)
             result = Wait(1, dest, *src);
 
-        REG_WAITCNT = (REG_WAITCNT & ~WAITCNT_SRAM_MASK) | WAITCNT_SRAM_8;
+        Backend::SetWait(ReadWait());
         return result;
     }
 
     static u16 WriteByte(u8 *dest, u8 b, bool wait = true) {
-        REG_WAITCNT = (REG_WAITCNT & ~WAITCNT_SRAM_MASK) | F.type.wait[0];
+        if constexpr (F.page != 0) {
+            return Program(dest, &b, 1);
+        }
+
+        dest = Map(dest);
+        Backend::SetWait(F.type.wait[0]);
 
-        FLASH_WRITE(0x5555, 0xAA);
-        FLASH_WRITE(0x2AAA, 0x55);
-        FLASH_WRITE(0x5555, 0xA0);
-        dest[0] = (u8)b;
+        Command(0x5555, 0xAA);
+        Command(0x2AAA, 0x55);
+        Command(0x5555, 0xA0);
+        Backend::Write(dest, b);
 
         u16 result = 0;
         if (wait)
             result = Wait(1, dest, b);
 
-        REG_WAITCNT = (REG_WAITCNT & ~WAITCNT_SRAM_MASK) | WAITCNT_SRAM_8;
+        Backend::SetWait(ReadWait());
         return result;
     }
 
+    // Loads a page and starts programming it; bytes of it src has none for read 0xFF afterwards.
+    // The chip commits the page once 150 us pass without a load, so an interrupt handler running
+    // in the middle would cut it short; interrupts are masked until all of it is loaded.
+    static void LoadPage(u8 *page, const u8 *src) {
+        page = Map(page);
+        const u16 ime = Backend::MaskIrq();
+        Backend::SetWait(F.type.wait[0]);
+
+        Command(0x5555, 0xAA);
+        Command(0x2AAA, 0x55);
+        Command(0x5555, 0xA0);
+        for (u32 i = 0; i < F.page; i++) {
+            Backend::Write(page + i, src != nullptr ? src[i] : 0xFF);
+        }
+
+        Backend::SetWait(ReadWait());
+        Backend::RestoreIrq(ime);
+    }
+
+    // Starts erasing one page of a sector, on parts that program a page at a time.
+    static void ErasePage(u16 sectorNum, u16 page) {
+        if constexpr (F.page != 0) {
+            LoadPage(PageAddress(sectorNum, page), nullptr);
+        }
+    }
+
+    // Programs size bytes from src to dest, waiting for each; dest must not cross into another bank.
+    // Bytes that are 0xFF are skipped, programming can only clear bits. Parts with unlock bypass
+    // are kept in it for the whole buffer, so each byte costs two bus writes instead of four; that
+    // only pays off from three bytes, as entering and leaving it takes five. Parts that program a
+    // page at a time get every page the buffer touches reloaded once, with the bits src clears.
+    static u16 Program(u8 *dest, const u8 *src, u32 size) {
+        if constexpr (F.page != 0) {
+            while (size != 0) {
+                u8 *page = Base() + ((dest - Base()) & ~(F.page - 1));
+                const u32 offset = dest - page;
+                const u32 count = size < F.page - offset ? size : F.page - offset;
+
+                u8 buf[F.page];
+                ReadMem(buf, page, F.page);
+                bool changed = false;
+                for (u32 i = 0; i < count; i++) {
+                    changed |= (buf[offset + i] & src[i]) != buf[offset + i];
+                    buf[offset + i] &= src[i];
+                }
+                if (changed) {
+                    LoadPage(page, buf);
+                    u16 result = Wait(1, page + F.page - 1, buf[F.page - 1]);
+                    if (result != 0) {
+                        return result;
+                    }
+                }
+
+                dest += count;
+                src += count;
+                size -= count;
+            }
+            return 0;
+        }
+
+        if (!F.unlockBypass || size < 3) {
+            for (u32 i = 0; i < size; i++) {
+                if (src[i] == 0xFF) {
+                    continue;
+                }
+                u16 result = WriteByte(dest + i, src[i]);
+                if (result != 0) {
+                    return result;
+                }
+            }
+            return 0;
+        }
+
+        dest = Map(dest);
+        Backend::SetWait(F.type.wait[0]);
+
+        Command(0x5555, 0xAA);
+        Command(0x2AAA, 0x55);
+        Command(0x5555, 0x20);
+
+        u16 result = 0;
+        for (u32 i = 0; i < size && result == 0; i++) {
+            if (src[i] == 0xFF) {
+                continue;
+            }
+            Backend::Write(dest + i, 0xA0);
+            Backend::Write(dest + i, src[i]);
+            result = Wait(1, dest + i, src[i]);
+        }
+
+        // unlock bypass reset, back to reading the array
+        Backend::Write(Base(), 0x90);
+        Backend::Write(Base(), 0x00);
+
+        Backend::SetWait(ReadWait());
+        return result;
+    }
+
+    // Without wait the erase is only started; poll Busy or Wait on the sector before touching the chip again.
+    // Parts that program a page at a time erase the pages from the last one down, so a header at the
+    // start of the sector goes last; without wait, only the last page is started, see ErasePage.
     static u16 EraseSector(u16 sectorNum, bool wait = true) {
         constexpr int numTries = 3;
-        u16 result;
+        u16 result = 0;
         u8 *addr;
 
         if (sectorNum >= F.type.sector.count) {
             return 0x80FF;
         }
 
-        SwitchBank(sectorNum / SECTORS_PER_BANK);
-        sectorNum %= SECTORS_PER_BANK;
+        if constexpr (F.page != 0) {
+            for (s16 page = PagesPerSector - 1; page >= 0; page--) {
+                ErasePage(sectorNum, page);
+                if (!wait) {
+                    break;
+                }
+                result = Wait(2, ErasePollAddress(sectorNum, page), 0xFF);
+                if (result != 0) {
+                    break;
+                }
+            }
+            return result;
+        }
+
+        addr = Map(SectorAddress(sectorNum));
 
         for (int i = 0; i < numTries; i++) {
-            REG_WAITCNT = (REG_WAITCNT & ~WAITCNT_SRAM_MASK) | F.type.wait[0];
-
-            addr = FLASH_BASE + (sectorNum << F.type.sector.shift);
+            Backend::SetWait(F.type.wait[0]);
 
-            FLASH_WRITE(0x5555, 0xAA);
-            FLASH_WRITE(0x2AAA, 0x55);
-            FLASH_WRITE(0x5555, 0x80);
-            FLASH_WRITE(0x5555, 0xAA);
-            FLASH_WRITE(0x2AAA, 0x55);
-            *addr = 0x30;
+            Command(0x5555, 0xAA);
+            Command(0x2AAA, 0x55);
+            Command(0x5555, 0x80);
+            Command(0x5555, 0xAA);
+            Command(0x2AAA, 0x55);
+            Backend::Write(addr, 0x30);
 
-            if (wait) {
-                result = Wait(2, addr, 0xFF);
+            if (!wait) {
+                break;
+            }
 
-                if (result == 0) {
-                    break;
-                }
+            result = Wait(2, addr, 0xFF);
+            if (result == 0) {
+                break;
             }
         }
 
-        REG_WAITCNT = (REG_WAITCNT & ~WAITCNT_SRAM_MASK) | WAITCNT_SRAM_8;
+        Backend::SetWait(ReadWait());
 
         return result;
     }
@@ -253,35 +586,29 @@ template <const Info &F = SST39SF512> class Chip {
             return 0x80FF;
         }
 
+        // one program command per page, which needs no erase before it
+        if constexpr (F.page != 0) {
+            for (u16 page = 0; page < PagesPerSector; page++) {
+                dest = PageAddress(sectorNum, page);
+                LoadPage(dest, src + page * F.page);
+                u16 result = Wait(1, dest + F.page - 1, src[(page + 1) * F.page - 1]);
+                if (result != 0) {
+                    return result;
+                }
+            }
+            return 0;
+        }
+
         u16 result = EraseSector(sectorNum);
 
         if (result != 0) {
             return result;
         }
 
-        SwitchBank(sectorNum / SECTORS_PER_BANK);
-        sectorNum %= SECTORS_PER_BANK;
-
         // SetReadFlash1((u8 *)readFlash1Buffer);
 
-        REG_WAITCNT = (REG_WAITCNT & ~WAITCNT_SRAM_MASK) | F.type.wait[0];
-
-        u16 flashNumRemainingBytes = F.type.sector.size;
-        dest = FLASH_BASE + (sectorNum << F.type.sector.shift);
-
-        while (flashNumRemainingBytes > 0) {
-            result = WriteByte(dest, src);
-
-            if (result != 0) {
-                break;
-            }
-
-            flashNumRemainingBytes--;
-            src++;
-            dest++;
-        }
-
-        REG_WAITCNT = (REG_WAITCNT & ~WAITCNT_SRAM_MASK) | WAITCNT_SRAM_8;
+        dest = SectorAddress(sectorNum);
+        Program(dest, src, F.type.sector.size);
 
         return 0;
     }
@@ -307,56 +634,38 @@ template <const Info &F = SST39SF512> class Chip {
     static u16 EraseChip() {
         u16 result;
 
-        REG_WAITCNT = (REG_WAITCNT & ~WAITCNT_SRAM_MASK) | F.type.wait[0];
+        Backend::SetWait(F.type.wait[0]);
 
         // initiate command
-        FLASH_WRITE(0x5555, 0xAA);
-        FLASH_WRITE(0x2AAA, 0x55);
+        Command(0x5555, 0xAA);
+        Command(0x2AAA, 0x55);
         // prepare erase
-        FLASH_WRITE(0x5555, 0x80);
+        Command(0x5555, 0x80);
         // initiate command
-        FLASH_WRITE(0x5555, 0xAA);
-        FLASH_WRITE(0x2AAA, 0x55);
+        Command(0x5555, 0xAA);
+        Command(0x2AAA, 0x55);
         // erase chip
-        FLASH_WRITE(0x5555, 0x10);
+        Command(0x5555, 0x10);
 
-        result = Wait(3, FLASH_BASE, 0xFF);
+        result = Wait(3, Backend::Base(), 0xFF);
 
-        REG_WAITCNT = (REG_WAITCNT & ~WAITCNT_SRAM_MASK) | WAITCNT_SRAM_8;
+        Backend::SetWait(ReadWait());
 
         return result;
     };
 
     static u32 VerifySector(u16 sectorNum, u8 *src) { return 0; }
 
-    template <class T> static u16 Write(const T &v, const T *dest) {
-        u8 *buf = (u8 *)&v;
-        u8 *dst = (u8 *)dest;
-        for (int i = 0; i < sizeof(T); i++) {
-            auto result = WriteByte(&dst[i], buf[i]);
-            if (result != 0) {
-                return result;
-            }
-        }
-        return 0;
-    }
+    // See Program.
+    template <class T> static u16 Write(const T &v, const T *dest) { return Program((u8 *)dest, (const u8 *)&v, sizeof(T)); }
 
-    template <class T> static T Read(const T *const src, ReadByteFunc &readByte) {
-        REG_WAITCNT = (REG_WAITCNT & ~WAITCNT_SRAM_MASK) | WAITCNT_SRAM_8;
+    template <class T> static T Read(const T *const src) {
+        u8 *from = Map(reinterpret_cast<const u8 *>(src));
 
         T out;
-        u8 *buf = (u8 *)&out;
-        u8 *addr = (u8 *)src;
-        for (int i = 0; i < sizeof(T); i++) {
-            buf[i] = readByte(&addr[i]);
-        }
-
+        ReadCoreFunc readFlashCore;
+        readFlashCore(from, (u8 *)&out, sizeof(T));
         return out;
     }
-
-    template <class T> static T Read(const T *const src) {
-        ReadByteFunc func;
-        return Read(src, func);
-    }
 };
 } // namespace Flash
\ No newline at end of file
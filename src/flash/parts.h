@@ -0,0 +1,46 @@
+#pragma once
+
+#include <flash/flash.h>
+
+namespace Flash {
+
+/*
+    Picks one of a fixed list of parts at runtime by the IDs the chip reports.
+
+    Code for each part is still built from its constexpr Info, so there is one copy per part and
+    none of them looks anything up at runtime; Visit only branches to the copy of the part found
+    by Detect. The first part is the fallback for a chip that reports unknown IDs.
+*/
+template <class Backend, const Info &Fallback, const Info &...Known> class Parts {
+    template <int I, const Info &Part, const Info &...Rest, class Fn> static auto VisitFrom(u8 index, Fn &fn) {
+        if constexpr (sizeof...(Rest) == 0) {
+            return fn.template operator()<Part>();
+        } else {
+            if (index == I) {
+                return fn.template operator()<Part>();
+            }
+            return VisitFrom<I + 1, Rest...>(index, fn);
+        }
+    }
+
+  public:
+    Parts() = delete;
+
+    static constexpr const Info &Default = Fallback;
+    static constexpr int Count = 1 + sizeof...(Known);
+    static_assert(Count < 256);
+
+    // Index of the part whose IDs the chip reports, 0 if none.
+    static u8 Detect() {
+        const u16 ids = Chip<Fallback, Backend>::ReadIds();
+        u8 found = 0;
+        u8 i = 1;
+        ((found = (found == 0 && (Known.type.ids.separate.makerID | Known.type.ids.separate.deviceID << 8) == ids) ? i : found, i++), ...);
+        return found;
+    }
+
+    // Returns fn.template operator()<Part>() for the part at index.
+    template <class Fn> static auto Visit(u8 index, Fn &&fn) { return VisitFrom<0, Fallback, Known...>(index, fn); }
+};
+
+} // namespace Flash
@@ -0,0 +1,534 @@
+#pragma once
+
+#include <algorithm>
+#include <flash/flash.h>
+
+namespace Flash {
+
+// Host-side model of a GBA flash part, usable in place of Cart as the backend of
+// Flash::Chip and JFlash::Journal so the journal can be built and measured natively.
+//
+// The model follows the JEDEC command protocol: programs and erases are only accepted
+// after the 0x5555/0x2AAA unlock sequence (or in unlock bypass, on parts that have it),
+// programming can only clear bits, and the smallest erase unit is a sector. Parts that
+// program a page per command replace the whole page instead and have no erase smaller
+// than the chip. 1M parts show one 64 KB bank at a time, selected by command 0xB0. Time is
+// kept in GBA CPU cycles: every bus access costs 1 + the configured SRAM wait states, and
+// every program or erase keeps the chip busy for the typical time given in the part's
+// Flash::Info; a page part starts programming a page on its own once PageTimeout passes
+// without a load. Accessing the chip while it is busy holds the bus until it is ready, as a
+// caller polling DQ7 would; only ReadStatus sees the chip's busy state. The timer interrupt
+// of the background eraser and VBlank are modelled too.
+class Sim {
+  public:
+    static constexpr u32 MaxSize = FLASH_ROM_SIZE_1M;
+    static constexpr u32 WorkRamSize = 0x10000;
+    static constexpr u64 CyclesPerSecond = 16 * 1024 * 1024;
+    static constexpr u64 FrameCycles = 280896; // one 59.73Hz video frame
+
+    struct Stats {
+        u64 cycles;          // simulated time since Reset
+        u64 busyCycles;      // time spent waiting for the chip to finish a program or erase
+        u64 eraseWaitCycles; // the part of busyCycles spent waiting for erases
+        u32 reads;           // bus reads
+        u32 writes;          // bus writes, commands included
+        u32 programs;        // bytes programmed
+        u32 sectorErases;    // sectors erased
+        u32 chipErases;      // full chip erases
+        u32 rejected;        // writes that broke the command protocol
+        u32 violations;      // programs that tried to turn a 0 bit back into a 1
+    };
+
+  private:
+    enum class Mode : u8 {
+        Ready,
+        Unlock1,
+        Unlock2,
+        Program,
+        EraseSetup,
+        EraseUnlock1,
+        EraseUnlock2,
+        Bank,
+        BypassReset,
+        PageLoad,
+    };
+
+    static constexpr u32 MaxPage = 256;
+    static constexpr u32 PageTimeout = 150; // us, the AT29's byte load cycle limit
+
+    static inline u8 mem[MaxSize];
+    static inline u8 page[MaxPage];
+    static inline u32 pageStart;
+    static inline u32 pageLoaded;
+    static inline u8 pageLast;
+    static inline u64 pageLoadedAt;
+    static inline u8 workRam[WorkRamSize];
+    static inline const Info *part = &SST39SF512;
+    static inline Stats stats;
+    static inline Mode mode;
+    static inline bool idMode;
+    static inline bool bypass;
+    static inline u8 bank;
+    static inline u8 bankCache;
+    static inline u8 readWaitCache;
+    static inline u16 fastestWait;
+    static inline u16 wait;
+    static inline u64 busyUntil;
+    static inline bool busyErasing;
+    static inline u8 busyData;
+    static inline u8 toggle;
+    static inline u64 timerPeriod;
+    static inline u64 timerNext;
+    static inline u64 timerStart;
+    static inline u16 timerReload;
+    static inline u32 timerPrescaler;
+    static inline bool timerRunning;
+    static inline bool timerIrq;
+    static inline bool vblankIrq;
+    static inline void (*irqHandler)();
+    static inline void (*chainedIrq)();
+
+    static u64 Micros(u32 us) { return (u64)us * CyclesPerSecond / 1000000; }
+
+    static constexpr u8 sramCycles[] = {5, 4, 3, 9};
+
+    static void Access() { stats.cycles += sramCycles[wait & WAITCNT_SRAM_MASK]; }
+
+    static void Settle() {
+        if (stats.cycles < busyUntil) {
+            stats.busyCycles += busyUntil - stats.cycles;
+            if (busyErasing) {
+                stats.eraseWaitCycles += busyUntil - stats.cycles;
+            }
+            stats.cycles = busyUntil;
+        }
+    }
+
+    // 1M parts decode 64 KB of the bus and show the selected bank there; smaller ones repeat.
+    static u32 Window(const u8 *addr) { return (u32)(addr - mem) % std::min<u32>(part->type.romSize, 0x10000); }
+    static u32 Offset(const u8 *addr) { return (bank * 0x10000 + Window(addr)) % part->type.romSize; }
+
+    static void Busy(u32 us, u8 data, bool erasing) {
+        busyUntil = stats.cycles + Micros(us);
+        busyData = data;
+        busyErasing = erasing;
+    }
+
+    static void Program(u32 offset, u8 data) {
+        if ((mem[offset] & data) != data) {
+            stats.violations++;
+        }
+        mem[offset] &= data;
+        stats.programs++;
+        Busy(part->timing.program, mem[offset], false);
+    }
+
+    // Page parts take the bytes of a page after the program command and then replace the whole
+    // page with them, bytes that weren't loaded read 0xFF.
+    static void LoadPage(u32 offset, u8 data) {
+        if (mode != Mode::PageLoad) {
+            mode = Mode::PageLoad;
+            pageStart = offset & ~(part->page - 1);
+            pageLoaded = 0;
+            std::fill(page, page + part->page, 0xFF);
+        }
+        page[offset - pageStart] = data;
+        pageLast = data;
+        pageLoadedAt = stats.cycles;
+        if (++pageLoaded == part->page) {
+            CommitPage();
+        }
+    }
+
+    static void CommitPage() {
+        mode = Mode::Ready;
+        std::copy(page, page + part->page, mem + pageStart);
+        stats.programs += pageLoaded;
+        Busy(part->timing.program, pageLast, false);
+    }
+
+    // Commits a page whose loading stopped for longer than the chip waits, programming from then on.
+    static void ExpirePage() {
+        const u64 timeout = pageLoadedAt + Micros(PageTimeout);
+        if (mode == Mode::PageLoad && stats.cycles > timeout) {
+            const u64 now = stats.cycles;
+            stats.cycles = timeout;
+            CommitPage();
+            stats.cycles = now;
+        }
+    }
+
+    static void EraseSector(u32 offset) {
+        u32 start = offset & ~(part->type.sector.size - 1);
+        for (u32 i = 0; i < part->type.sector.size; i++) {
+            mem[start + i] = 0xFF;
+        }
+        stats.sectorErases++;
+        Busy(part->timing.eraseSector, 0xFF, true);
+    }
+
+    static void EraseChip() {
+        for (u32 i = 0; i < part->type.romSize; i++) {
+            mem[i] = 0xFF;
+        }
+        stats.chipErases++;
+        Busy(part->timing.eraseChip, 0xFF, true);
+    }
+
+    static void Reject() {
+        stats.rejected++;
+        mode = Mode::Ready;
+    }
+
+  public:
+    Sim() = delete;
+
+    // Blank chip of the given part, zeroed statistics.
+    static void Reset(const Info &info = SST39SF512) {
+        part = &info;
+        for (u32 i = 0; i < MaxSize; i++) {
+            mem[i] = 0xFF;
+        }
+        for (u32 i = 0; i < WorkRamSize; i++) {
+            workRam[i] = 0;
+        }
+        stats = {};
+        mode = Mode::Ready;
+        idMode = false;
+        bypass = false;
+        bank = 0;
+        bankCache = 0xFF;
+        readWaitCache = 0xFF;
+        fastestWait = WAITCNT_SRAM_2;
+        wait = WAITCNT_SRAM_8;
+        busyUntil = 0;
+        busyErasing = false;
+        busyData = 0xFF;
+        toggle = 0;
+        timerPeriod = 0;
+        timerRunning = false;
+        timerIrq = false;
+        vblankIrq = false;
+        irqHandler = nullptr;
+        chainedIrq = nullptr;
+    }
+
+    // Power loss: RAM contents and any half-entered command are gone, flash is kept.
+    static void PowerCycle() {
+        Settle();
+        for (u32 i = 0; i < WorkRamSize; i++) {
+            workRam[i] = 0;
+        }
+        mode = Mode::Ready;
+        idMode = false;
+        bypass = false;
+        bank = 0;
+        bankCache = 0xFF;
+        readWaitCache = 0xFF;
+        timerPeriod = 0;
+        timerRunning = false;
+        timerIrq = false;
+        vblankIrq = false;
+        irqHandler = nullptr;
+        chainedIrq = nullptr;
+    }
+
+    static const Stats &GetStats() { return stats; }
+    static const Info &Part() { return *part; }
+
+    // Lets simulated time pass without touching the bus, e.g. the game running between two saves.
+    static void Idle(u64 cycles) {
+        u64 end = stats.cycles + cycles;
+        while (irqHandler != nullptr) {
+            u64 vblank = (stats.cycles / FrameCycles + 1) * FrameCycles;
+            u64 next = timerPeriod != 0 ? std::min(timerNext, vblank) : vblank;
+            if (next > end) {
+                break;
+            }
+
+            stats.cycles = std::max(stats.cycles, next);
+            if (timerPeriod != 0 && timerNext <= next) {
+                timerNext += timerPeriod;
+                timerIrq = true;
+            }
+            vblankIrq = next == vblank;
+            irqHandler();
+            vblankIrq = false;
+        }
+        stats.cycles = std::max(stats.cycles, end);
+        ExpirePage();
+    }
+
+    // Direct access to the array contents, bypassing the bus and the clock.
+    static u8 *Image() { return mem; }
+
+    static u8 *Base() { return mem; }
+    static uintptr_t WorkRamEnd() { return (uintptr_t)(workRam + WorkRamSize); }
+
+    static void SetWait(u16 w) { wait = w & WAITCNT_SRAM_MASK; }
+    static u16 CurrentWait() { return wait; }
+
+    // Interrupts are only delivered during Idle, which never runs inside a masked section.
+    static u16 MaskIrq() { return 1; }
+    static void RestoreIrq(u16) {}
+
+    // Bank last selected by Chip, 0xFF when unknown; lost with the rest of RAM on power loss.
+    static u8 *BankCache() { return &bankCache; }
+    static u8 *ReadWaitCache() { return &readWaitCache; }
+    static void (**ChainedIrq())() { return &chainedIrq; }
+
+    // Reads with fewer wait states than this, WAITCNT_SRAM_2 after Reset, return flipped bits.
+    static void SetFastestWait(u16 w) { fastestWait = w & WAITCNT_SRAM_MASK; }
+
+    static constexpr int Timer = 3;
+
+    // One timer and VBlank, whose interrupts are only delivered during Idle, i.e. while the game runs.
+    static void StartTimer(u16 reload, u16 control) {
+        static constexpr u32 prescaler[] = {1, 64, 256, 1024};
+        timerPeriod = 0;
+        timerRunning = (control & TIMER_ENABLE) != 0;
+        timerStart = stats.cycles;
+        timerReload = reload;
+        timerPrescaler = prescaler[control & 3];
+        if (timerRunning && (control & TIMER_INTR_ENABLE)) {
+            timerPeriod = (0x10000 - reload) * timerPrescaler;
+            timerNext = stats.cycles + timerPeriod;
+        }
+    }
+
+    static void StopTimer() {
+        timerPeriod = 0;
+        timerRunning = false;
+    }
+
+    static u16 TimerCount() {
+        if (!timerRunning) {
+            return timerReload;
+        }
+        return timerReload + (stats.cycles - timerStart) / timerPrescaler % (0x10000 - timerReload);
+    }
+
+    static bool TakeTimerIrq() {
+        bool pending = timerIrq;
+        timerIrq = false;
+        return pending;
+    }
+
+    static bool VBlankPending() { return vblankIrq; }
+
+    static void OnUserStack(void (*fn)()) { fn(); }
+
+    // There is no game handler to chain to.
+    static void HookIrq(void (*handler)()) {
+        irqHandler = handler;
+        chainedIrq = nullptr;
+    }
+
+    static u8 Read(const u8 *addr) {
+        if (mode == Mode::PageLoad) {
+            CommitPage();
+        }
+        Access();
+        Settle();
+        stats.reads++;
+
+        u32 offset = Offset(addr);
+        if (idMode && Window(addr) < 2) {
+            return Window(addr) == 0 ? part->type.ids.separate.makerID : part->type.ids.separate.deviceID;
+        }
+        if (sramCycles[wait] < sramCycles[fastestWait]) {
+            return mem[offset] ^ (1 << (stats.reads & 7));
+        }
+        return mem[offset];
+    }
+
+    // Status read for polling: while the chip is busy it answers with DQ7 inverted from the
+    // data being written and DQ6 toggling on every read, instead of holding the bus.
+    static u8 ReadStatus(const u8 *addr) {
+        if (mode == Mode::PageLoad) {
+            CommitPage();
+        }
+        if (stats.cycles >= busyUntil) {
+            return Read(addr);
+        }
+
+        const u64 start = stats.cycles;
+        Access();
+        stats.reads++;
+        stats.busyCycles += stats.cycles - start;
+        if (busyErasing) {
+            stats.eraseWaitCycles += stats.cycles - start;
+        }
+        toggle ^= 0x40;
+        return (~busyData & 0x80) | toggle;
+    }
+
+    static void Write(u8 *addr, u8 data) {
+        Access();
+        ExpirePage();
+        Settle();
+        stats.writes++;
+
+        u32 offset = Window(addr);
+
+        switch (mode) {
+        case Mode::Program:
+            if (part->page != 0) {
+                LoadPage(Offset(addr), data);
+                return;
+            }
+            mode = Mode::Ready;
+            Program(Offset(addr), data);
+            return;
+        case Mode::PageLoad:
+            if (Offset(addr) - pageStart < part->page) {
+                LoadPage(Offset(addr), data);
+                return;
+            }
+            CommitPage();
+            break;
+        case Mode::EraseUnlock2:
+            mode = Mode::Ready;
+            if (offset == 0x5555 && data == 0x10) {
+                EraseChip();
+            } else if (data == 0x30 && part->page == 0) {
+                EraseSector(Offset(addr));
+            } else {
+                Reject();
+            }
+            return;
+        case Mode::BypassReset:
+            mode = Mode::Ready;
+            if (data == 0x00) {
+                bypass = false;
+            } else {
+                Reject();
+            }
+            return;
+        case Mode::Bank:
+            mode = Mode::Ready;
+            if (offset == 0 && (u32)data * 0x10000 < part->type.romSize) {
+                bank = data;
+            } else {
+                Reject();
+            }
+            return;
+        default:
+            break;
+        }
+
+        if (bypass) {
+            // unlock bypass: only 0xA0 + data and the 0x90/0x00 reset are taken, at any address
+            if (data == 0xA0) {
+                mode = Mode::Program;
+            } else if (data == 0x90) {
+                mode = Mode::BypassReset;
+            } else {
+                Reject();
+            }
+            return;
+        }
+
+        if (data == 0xF0 && mode == Mode::Ready) {
+            // software reset, also leaves ID mode
+            idMode = false;
+            return;
+        }
+
+        if (mode == Mode::Ready && offset == 0x5555 && data == 0xAA) {
+            mode = Mode::Unlock1;
+        } else if (mode == Mode::Unlock1 && offset == 0x2AAA && data == 0x55) {
+            mode = Mode::Unlock2;
+        } else if (mode == Mode::Unlock2 && offset == 0x5555) {
+            switch (data) {
+            case 0xA0:
+                mode = Mode::Program;
+                break;
+            case 0x80:
+                mode = Mode::EraseSetup;
+                break;
+            case 0x90:
+                idMode = true;
+                mode = Mode::Ready;
+                break;
+            case 0xF0:
+                idMode = false;
+                mode = Mode::Ready;
+                break;
+            case 0x20:
+                if (part->unlockBypass) {
+                    bypass = true;
+                    mode = Mode::Ready;
+                } else {
+                    Reject();
+                }
+                break;
+            case 0xB0:
+                if (part->type.romSize == FLASH_ROM_SIZE_1M) {
+                    mode = Mode::Bank;
+                } else {
+                    Reject();
+                }
+                break;
+            default:
+                Reject();
+                break;
+            }
+        } else if (mode == Mode::EraseSetup && offset == 0x5555 && data == 0xAA) {
+            mode = Mode::EraseUnlock1;
+        } else if (mode == Mode::EraseUnlock1 && offset == 0x2AAA && data == 0x55) {
+            mode = Mode::EraseUnlock2;
+        } else {
+            Reject();
+        }
+    }
+
+    static void Install() {}
+
+    static bool Poll(u8 *addr, u8 lastData, u32 tries) {
+        while (tries-- != 0) {
+            if (Read(addr) == lastData) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static u32 Scan(const u8 *field, u8 stride, u32 count, u16 target, u16 *out, u16 shortFlag, u8 shortStride) {
+        u32 i = 0;
+        for (; i < count; i++) {
+            u16 value = Read(field) | Read(field + 1) << 8;
+            if (out != nullptr) {
+                *out++ = value;
+            }
+            if (value == target) {
+                break;
+            }
+            field += (value & shortFlag) ? shortStride : stride;
+        }
+        return i;
+    }
+
+    static bool Blank(const u8 *addr, u32 size) {
+        while (size-- != 0) {
+            if (Read(addr++) != 0xFF) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    struct ReadByteFunc {
+        u8 operator()(u8 *addr) const { return Read(addr); }
+    };
+
+    struct ReadCoreFunc {
+        void operator()(u8 *src, u8 *dest, u32 size) const {
+            while (size-- != 0) {
+                *dest++ = Read(src++);
+            }
+        }
+    };
+};
+
+} // namespace Flash
@@ -1,41 +1,147 @@
 #include <flash/flash.h>
+#include <flash/parts.h>
 #include <jflash/jflash.h>
 #include <sram/sram.h>
+#include <trace/recorder.h>
 
-using FlashChip = Flash::Chip<Flash::SST39SF512>;
-using Journal = JFlash::Journal<FlashChip::Info>;
+#ifdef FLASH_SIM
+#include <flash/sim.h>
+using FlashBackend = Flash::Sim;
+#else
+using FlashBackend = Flash::Cart;
+#endif
+
+// Chips the patch drives, told apart by their IDs; a chip whose IDs match none of them is driven as
+// an SST39SF512. Each one takes its own copy of the journal, so a patch for a cart whose chip is
+// known can list just that one (make PART=MX29L512) and comes out about a third the size.
+#ifndef FLASHPATCH_PARTS
+#define FLASHPATCH_PARTS Flash::SST39VF512, Flash::MX29L512, Flash::MN63F805MNP, Flash::MX29L010, Flash::LE26FV10N1TS, Flash::AT29LV512
+#endif
+using FlashParts = Flash::Parts<FlashBackend, Flash::SST39SF512, FLASHPATCH_PARTS>;
+
+// Writes made without wait that may wait in RAM for VBlank, see Journal::DrainFrames.
+#ifndef FLASHPATCH_WRITE_QUEUE
+#define FLASHPATCH_WRITE_QUEUE 16
+#endif
+
+// Set to look for the fastest read wait the chip takes at boot instead of reading at 8 wait
+// states, see Chip::CalibrateWait.
+#ifndef FLASHPATCH_CALIBRATE_WAIT
+#define FLASHPATCH_CALIBRATE_WAIT 0
+#endif
+
+// Set to keep the whole EEPROM in EWRAM below the journal's state, 8 KB more of it, so reads are
+// copies from RAM.
+#ifndef FLASHPATCH_SHADOW
+#define FLASHPATCH_SHADOW 0
+#endif
+
+// Clear to keep no index of the journal in EWRAM, 4 KB less of it, for games that need that RAM;
+// reads then search the chip, skipping the sectors whose summary doesn't list the variable.
+#ifndef FLASHPATCH_INDEX
+#define FLASHPATCH_INDEX 1
+#endif
+
+template <const Flash::Info &F> using JournalFor = JFlash::Journal<F, 8 * 1024, FlashBackend, FLASHPATCH_WRITE_QUEUE, FLASHPATCH_SHADOW, FLASHPATCH_INDEX>;
+using DefaultJournal = JournalFor<FlashParts::Default>;
+
+// Build with FLASHPATCH_TRACE (make TRACE=1) to record every hook call, see trace/recorder.h.
+#ifdef FLASHPATCH_TRACE
+#ifdef FLASH_SIM
+#error "the trace recorder needs cartridge hardware"
+#endif
+#ifndef FLASHPATCH_TRACE_RAM
+#define FLASHPATCH_TRACE_RAM (EWRAM + 0x38000)
+#endif
+#ifndef FLASHPATCH_TRACE_ENTRIES
+#define FLASHPATCH_TRACE_ENTRIES 1024
+#endif
+// timers 1 and 2, FLASH_TIMER (3) belongs to the background eraser
+#ifndef FLASHPATCH_TRACE_TIMER
+#define FLASHPATCH_TRACE_TIMER 1
+#endif
+using Recorder = Trace::Recorder<FLASHPATCH_TRACE_RAM, FLASHPATCH_TRACE_ENTRIES, FLASHPATCH_TRACE_TIMER>;
+// the ring ends below the journal's RAM and the part slot
+static_assert(FLASHPATCH_TRACE_RAM + Recorder::Size + DefaultJournal::RamBytes + 4 <= EWRAM + EWRAM_SIZE);
+#else
+using Recorder = Trace::NullRecorder;
+#endif
+static_assert(Recorder::Size <= sizeof(DefaultJournal::Partition));
+
+namespace {
+
+// Detected part, kept just below the journal's RAM, which is the same for every part.
+constexpr u32 PartMagic = 0x50415200; // "\0RAP"
+
+__attribute__((always_inline)) inline u32 *PartSlot() { return reinterpret_cast<u32 *>(DefaultJournal::RamStart() - 4); }
+
+// Calls fn.template operator()<Journal>() with the journal of the chip on the cart. The chip is
+// only identified on the first call, and again if the game cleared the RAM.
+template <class Fn> auto WithJournal(Fn &&fn) {
+    u32 slot = *PartSlot();
+    if ((slot & ~0xFFu) != PartMagic) {
+        slot = PartMagic | FlashParts::Detect();
+        *PartSlot() = slot;
+    }
+    return FlashParts::Visit(slot & 0xFF, [&]<const Flash::Info &F>() { return fn.template operator()<JournalFor<F>>(); });
+}
+
+} // namespace
 
 extern "C" {
 
 void ROMInit();
 
+#ifndef FLASH_SIM
 __attribute__((naked, target("no-thumb-mode"))) void Entrypoint() {
     asm("ldr lr, .orig");
     asm("b ROMInit");
     asm(".orig: .long 0x080000c0");
 }
+#endif
 
-void ROMInit() { FlashChip::Init(); }
+static void DumpTraceOnRequest() {
+    if (Recorder::DumpRequested()) {
+        WithJournal([]<class Journal>() {
+            Journal::WithSparePartition([](typename Journal::Partition *spare) { return Recorder::template Dump<typename Journal::Chip>(reinterpret_cast<u8 *>(spare)); });
+        });
+    }
+}
+
+void ROMInit() {
+    *PartSlot() = PartMagic | FlashParts::Detect();
+#if FLASHPATCH_CALIBRATE_WAIT
+    WithJournal([]<class Journal>() { Journal::CalibrateWait(); });
+#endif
+    Recorder::Init();
+}
 
-u16 EEPROMConfigure(u16) {
-    Journal::Init();
+u16 EEPROMConfigure(u16 size) {
+    Recorder::Record(Trace::CONFIGURE, size, nullptr, true);
+    WithJournal([]<class Journal>() { Journal::Init(); });
+    DumpTraceOnRequest();
     return 0;
 }
 
 u16 EEPROMWrite(u16 addr, u8 data[8], bool8 wait) {
+    Recorder::Record(Trace::WRITE, addr, data, wait);
+    DumpTraceOnRequest();
     JFlash::Variable *v = reinterpret_cast<JFlash::Variable *>(data);
-    return Journal::WriteVar(addr, *v);
+    return WithJournal([&]<class Journal>() { return Journal::WriteVar(addr, *v, wait); });
 }
 
 u16 EEPROMRead(u16 address, u8 data[8]) {
-    auto var = Journal::ReadVar(address);
+    auto var = WithJournal([&]<class Journal>() { return Journal::ReadVar(address); });
     for (int i = 0; i < sizeof(var.data); i++) {
         data[i] = var.data[i];
     }
 
+    Recorder::Record(Trace::READ, address, data, true);
+    DumpTraceOnRequest();
     return 0;
 }
 
+#ifndef FLASH_SIM
 void __aeabi_memcpy(void *dest, void *src, size_t n) {
     u8 *d = (u8 *)dest;
     u8 *s = (u8 *)src;
@@ -44,4 +150,5 @@ void __aeabi_memcpy(void *dest, void *src, size_t n) {
         n--;
     }
 }
-}
\ No newline at end of file
+#endif
+}
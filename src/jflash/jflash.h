@@ -1,6 +1,7 @@
 #pragma once
 
 #include <common/utils.h>
+#include <flash/eraser.h>
 #include <flash/flash.h>
 #include <gba/types.h>
 
@@ -17,6 +18,14 @@ enum State : u32 {
 static_assert(RECEIVING == 0xFFFFFF00);
 static_assert(ERASING == 0);
 
+// Frame layout of a partition, programmed into its header before it receives frames.
+enum Layout : u8 {
+    // LegacyFrame; the first versions left the header byte erased
+    LEGACY = 0xFF,
+    // Frame
+    COMPACT = 0x01,
+};
+
 struct Header {
     union {
         struct {
@@ -27,7 +36,10 @@ struct Header {
         };
         State state;
     };
-    u32 reserved[3];
+    Layout layout;
+    // 0 once the partition keeps a summary of each filled sector at its end, see Journal::Summary
+    u8 summaries;
+    u8 reserved[10];
 };
 static_assert(sizeof(Header) == 16);
 
@@ -44,300 +56,1290 @@ struct Variable {
     }
 };
 
-struct Frame {
+// Frame of the first versions, still mounted and compacted from.
+struct LegacyFrame {
     u16 addr;
     u8 reserved[6] = {0, 0, 0, 0, 0, 0};
     Variable data;
 };
 
-static_assert(sizeof(Frame) == 16);
+static_assert(sizeof(LegacyFrame) == 16);
+
+// CRC-8 with polynomial 0x07, continuing from crc.
+static inline u8 Crc8(const u8 *bytes, int size, u8 crc = 0) {
+    for (int i = 0; i < size; i++) {
+        crc ^= bytes[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+// Records are programmed first to last byte, so check going in last tells a complete record from
+// one cut short by a power loss. Bytes left at 0xFF are not programmed at all.
+struct Frame {
+    u16 addr;
+    Variable data;
+    // CRC-8 of addr and data as first programmed
+    u8 check;
+    // 0 once data has been overwritten in place, which check doesn't follow
+    u8 spare = 0xFF;
+
+    static u8 Check(u16 addr, const Variable &data) { return Crc8(data.data, sizeof(data.data), Crc8(reinterpret_cast<const u8 *>(&addr), sizeof(addr))); }
+};
+
+static_assert(sizeof(Frame) == 12);
+
+// The bytes of a variable that differ from its base, the newest frame of the variable before it
+// in the same partition. Takes half the room of a frame; only found in compact partitions.
+struct Delta {
+    static constexpr u16 Flag = 0x4000;
+    static constexpr int MaxBytes = 2;
+
+    // variable | Flag
+    u16 addr;
+    // bit n set: byte n of the variable differs from the base
+    u8 mask;
+    // the differing bytes, in order
+    u8 bytes[MaxBytes] = {0xFF, 0xFF};
+    // CRC-8 of the bytes above
+    u8 check;
+
+    u8 Check() const { return Crc8(reinterpret_cast<const u8 *>(this), offsetof(Delta, check)); }
+
+    void ApplyTo(Variable &value) const {
+        for (int i = 0, n = 0; i < sizeof(value.data) && n < MaxBytes; i++) {
+            if (mask & (1 << i)) {
+                value.data[i] = bytes[n++];
+            }
+        }
+    }
+};
+
+static_assert(sizeof(Delta) == 6 && sizeof(Frame) % sizeof(Delta) == 0);
 
-template <const Flash::Info &F, const int EEPROMSize = (8 * 1024)> class Journal {
+// Index of a journal's records, in its RAM state unless it looks variables up on flash.
+template <int NumVars, bool Indexed> struct IndexRam {
+    // Unit of the newest record of each variable, NoFrame if there is none.
+    u16 FrameIndex[NumVars];
+    // Unit of the frame that record is or applies to.
+    u16 BaseIndex[NumVars];
+};
+template <int NumVars> struct IndexRam<NumVars, false> {};
+
+// WriteQueueDepth bounds how many variables written without wait can sit in RAM, i.e. be lost on a crash;
+// a full queue takes DrainFrames VBlanks to be written out.
+// Shadowed keeps a copy of every variable in RAM below the journal's state, EEPROMSize more bytes of
+// it, so reads don't touch the chip. Without Indexed, the journal keeps no index of the records in
+// RAM, EEPROMSize / 2 bytes less of it, and looks variables up on flash, guided by the summaries it
+// writes of each sector it fills.
+template <const Flash::Info &F, const int EEPROMSize = (8 * 1024), class Backend = Flash::Cart, const int WriteQueueDepth = 16, const bool Shadowed = false,
+          const bool Indexed = true>
+class Journal {
   public:
     Journal() = delete;
-    using Chip = Flash::Chip<F>;
+    using Chip = Flash::Chip<F, Backend>;
+    using Eraser = Flash::Eraser<Chip, Backend>;
 
-    constexpr static int PartitionMaxFrames = ((F.type.romSize / 2) / sizeof(Frame)) - 1;
-    constexpr static int TotalFrames = PartitionMaxFrames * 2;
+    // Parts that program a page at a time keep the header in a page of its own, so writing frames never reloads it.
+    constexpr static int HeaderBytes = F.page != 0 ? F.page : sizeof(Header);
+    constexpr static int FrameBytes = (F.type.romSize / 2) - HeaderBytes;
+    constexpr static int PartitionMaxFrames = FrameBytes / sizeof(Frame);
+    constexpr static int LegacyMaxFrames = FrameBytes / sizeof(LegacyFrame);
     constexpr static int NumVars = EEPROMSize / sizeof(Variable);
 
+    // Records are laid out as the header's layout says, back to back from the start of frames.
     struct Partition {
         Header header;
-        Frame frames[PartitionMaxFrames];
+        alignas(HeaderBytes) u8 frames[FrameBytes];
 
         static constexpr int numSectors = F.type.sector.count / 2;
     };
     static_assert(sizeof(Partition) == (F.type.romSize / 2));
-    static_assert(sizeof(Partition::frames) == sizeof(Frame) * PartitionMaxFrames);
-    static_assert(sizeof(Partition::frames) + sizeof(Partition::header) == F.type.romSize / 2);
     static_assert(Partition::numSectors > 0);
 
+    // Which variables have a record starting in a sector of a partition. A partition whose header
+    // says so keeps one for every sector but the last at the end of its frames; each is written
+    // once the records of the active partition have moved past the sector.
+    struct Summary {
+        // bit n clear: a record of variable n starts in the sector
+        u8 absent[(NumVars + 7) / 8];
+        // unit of the first record starting in the sector, and of the first one after it
+        s16 first;
+        s16 end;
+        // programmed to 0 after the rest, so a summary cut short is written again
+        u8 done;
+        u8 reserved[3];
+    };
+    // Room the summaries take off the frames, whole pages on parts that program a page at a time.
+    constexpr static int SummaryBytes = (((Partition::numSectors - 1) * sizeof(Summary) + HeaderBytes - 1) / HeaderBytes) * HeaderBytes;
+    static_assert(Indexed || (Partition::numSectors > 1 && SummaryBytes < F.type.sector.size));
+
+    // Records start on a grid of units: a delta is one unit of a compact partition, a frame two.
+    __attribute__((always_inline)) static u8 UnitSize(Layout layout) { return layout == COMPACT ? sizeof(Delta) : sizeof(LegacyFrame); }
+    __attribute__((always_inline)) static u8 FrameUnits(Layout layout) { return layout == COMPACT ? sizeof(Frame) / sizeof(Delta) : 1; }
+    __attribute__((always_inline)) static u8 DataOffset(Layout layout) { return layout == COMPACT ? offsetof(Frame, data) : offsetof(LegacyFrame, data); }
+    __attribute__((always_inline)) static s16 MaxUnits(Layout layout, bool summarized = false) { return (FrameBytes - (summarized ? SummaryBytes : 0)) / UnitSize(layout); }
+
   private:
-    class compactProgress {
-      public:
-        static constexpr size_t Size = EEPROMSize / 8;
-
-      private:
-        u8 progress[Size];
-        class reference {
-          public:
-            u8 *parent;
-
-            reference(u8 *p) : parent(p) {}
-            reference &operator=(bool b) {
-                if (b) {
-                    *parent |= 0x80;
-                } else {
-                    *parent &= 0x7F;
+    static constexpr u16 NoFrame = 0xFFFF;
+    // Set in an index entry whose record is still in the sending partition of a running compaction.
+    static constexpr u16 InSending = 0x8000;
+    // Set in a FrameIndex entry that is a delta.
+    static constexpr u16 IsDelta = 0x4000;
+    static constexpr u16 UnitMask = IsDelta - 1;
+    static constexpr u32 MountedMagic = 0x534C464A; // "JFLS"
+
+    // Live frames copied per step of a compaction. Every write during a compaction also takes a
+    // step, so the receiving partition has to fit all variables plus the writes made meanwhile.
+    static constexpr int CompactFramesPerStep = 4;
+    // VBlanks a full write queue takes to be written out in the background; a deeper queue writes out
+    // more variables per VBlank, which keep interrupts masked for longer.
+    static constexpr int DrainFrames = 16;
+    static constexpr int FlushesPerVBlank = (WriteQueueDepth + DrainFrames - 1) / DrainFrames;
+    static_assert(NumVars + NumVars / CompactFramesPerStep + 1 <= LegacyMaxFrames);
+    static_assert((NumVars + NumVars / CompactFramesPerStep + 1) * sizeof(Frame) <= FrameBytes - SummaryBytes);
+    // a shadow answers every read from RAM, and takes more of it than an index
+    static_assert(Indexed || !Shadowed);
+    static_assert(FrameBytes / sizeof(Delta) <= UnitMask && NumVars <= Delta::Flag);
+    static_assert(WriteQueueDepth > 0 && WriteQueueDepth < 256);
+
+    enum class Compaction : u8 {
+        Idle,
+        // live frames of the sending partition are copied into the receiving one
+        Copy,
+        // the old partition is erased in the background
+        Erase,
+    };
+
+    struct QueuedWrite {
+        u16 addr;
+        Variable data;
+    };
+
+    // Newest record of a variable and the frame it is or applies to, as index entries.
+    struct Located {
+        u16 entry;
+        u16 base;
+    };
+
+    struct globals : IndexRam<NumVars, Indexed> {
+        // First free unit of the active partition.
+        s16 NextFrame;
+        // Partition new frames go to; during a compaction, the receiving one.
+        u8 ActivePartition;
+        // Frame layout of each partition.
+        Layout Layouts[2];
+        Compaction Phase;
+        // Next variable to copy.
+        u16 CopyCursor;
+        u32 Mounted;
+        // Erases the old partition, last sector first so the header goes last.
+        typename Eraser::State Erase;
+        // Variables written without wait, oldest first, at most one per address.
+        QueuedWrite WriteQueue[WriteQueueDepth];
+        u8 QueueLength;
+        // Whether each partition keeps sector summaries.
+        bool Summarized[2];
+    };
+
+    __attribute__((always_inline)) static globals *Globals() { return reinterpret_cast<globals *>(Align<4>((Backend::WorkRamEnd() - 1) - sizeof(globals))); }
+    // Newest value of every variable, queued writes included; valid while mounted.
+    __attribute__((always_inline)) static Variable *Shadow() { return reinterpret_cast<Variable *>(reinterpret_cast<uintptr_t>(Globals()) - sizeof(Variable) * NumVars); }
+    __attribute__((always_inline)) static Partition *Partition0() { return reinterpret_cast<Partition *>(Chip::Base()); }
+    __attribute__((always_inline)) static Partition *Partition1() { return reinterpret_cast<Partition *>(Chip::Base() + (F.type.romSize / 2)); }
+    __attribute__((always_inline)) static Partition *PartitionAt(u8 n) { return n == 0 ? Partition0() : Partition1(); }
+
+    static u8 *RecordAt(u8 partition, u16 unit) { return PartitionAt(partition)->frames + unit * UnitSize(Globals()->Layouts[partition]); }
+
+    static u8 PartitionOf(u16 entry) { return (entry & InSending) ? Globals()->ActivePartition ^ 1 : Globals()->ActivePartition; }
+
+    static const Variable *DataAt(u16 entry) {
+        u8 partition = PartitionOf(entry);
+        return reinterpret_cast<const Variable *>(RecordAt(partition, entry & UnitMask) + DataOffset(Globals()->Layouts[partition]));
+    }
+
+    // Records are put together in RAM, 4-byte aligned, before they are programmed.
+    static constexpr int MaxRecordBytes = sizeof(LegacyFrame);
+
+    static void BuildFrame(Layout layout, u16 addr, const Variable &data, u8 *out) {
+        if (layout == COMPACT) {
+            *reinterpret_cast<Frame *>(out) = Frame{.addr = addr, .data = data, .check = Frame::Check(addr, data)};
+        } else {
+            *reinterpret_cast<LegacyFrame *>(out) = LegacyFrame{.addr = addr, .data = data};
+        }
+    }
+
+    static u16 WriteFrame(u8 partition, u16 frame, u16 addr, const Variable &data) {
+        const Layout layout = Globals()->Layouts[partition];
+        alignas(4) u8 record[MaxRecordBytes];
+        BuildFrame(layout, addr, data, record);
+        return Chip::Program(RecordAt(partition, frame), record, FrameUnits(layout) * UnitSize(layout));
+    }
+
+    // Record addresses fetched per call of the scan routine.
+    static constexpr int ScanChunk = 64;
+
+    // Whether the record at unit of a compact partition was programmed to its end.
+    static bool Complete(u8 partition, u16 unit, bool delta) {
+        if (delta) {
+            const Delta d = Chip::Read(reinterpret_cast<const Delta *>(RecordAt(partition, unit)));
+            return d.check == d.Check();
+        }
+        const Frame f = Chip::Read(reinterpret_cast<const Frame *>(RecordAt(partition, unit)));
+        return f.spare == 0 || f.check == Frame::Check(f.addr, f.data);
+    }
+
+    __attribute__((always_inline)) static Summary *SummaryAt(u8 partition, int sector) {
+        return reinterpret_cast<Summary *>(PartitionAt(partition)->frames + FrameBytes - SummaryBytes) + sector;
+    }
+
+    // Sector of its partition a record starts in.
+    static int SectorOf(u8 partition, s16 unit) { return (HeaderBytes + unit * UnitSize(Globals()->Layouts[partition])) >> F.type.sector.shift; }
+
+    // Newest sector with a summary, -1 if there is none. Summaries are written in sector order.
+    static int LastSummary(u8 partition) {
+        if (!Globals()->Summarized[partition]) {
+            return -1;
+        }
+        int sector = Partition::numSectors - 2;
+        while (sector >= 0 && Chip::Read(&SummaryAt(partition, sector)->done) != 0) {
+            sector--;
+        }
+        return sector;
+    }
+
+    // First unit of a partition no summary covers.
+    static s16 TailOf(u8 partition) {
+        const int sector = LastSummary(partition);
+        return sector >= 0 ? Chip::Read(&SummaryAt(partition, sector)->end) : 0;
+    }
+
+    // Newest complete record of addr from unit from up to unit to of a partition, deltas only if
+    // asked for; an index entry without InSending, NoFrame if there is none.
+    static u16 LastRecord(u8 partition, u16 addr, s16 from, s16 to, bool deltas) {
+        const Layout layout = Globals()->Layouts[partition];
+        const u16 deltaFlag = layout == COMPACT ? Delta::Flag : 0;
+
+        while (from < to) {
+            u16 found = NoFrame;
+            u16 addrs[ScanChunk];
+            s16 unit = from;
+            while (unit < to) {
+                const int used = Chip::Scan(RecordAt(partition, unit), UnitSize(layout) * FrameUnits(layout), ScanChunk, 0xFFFF, addrs, deltaFlag, UnitSize(layout));
+                for (int i = 0; i < used && unit < to; i++) {
+                    const bool delta = addrs[i] & deltaFlag;
+                    if ((addrs[i] & ~deltaFlag) == addr && (deltas || !delta)) {
+                        found = unit | (delta ? IsDelta : 0);
+                    }
+                    unit += delta ? 1 : FrameUnits(layout);
+                }
+                if (used < ScanChunk) {
+                    break;
                 }
+            }
+            if (found == NoFrame || layout != COMPACT || Complete(partition, found & UnitMask, found & IsDelta)) {
+                return found;
+            }
+            // cut short by a power loss; the one before counts
+            to = found & UnitMask;
+        }
+        return NoFrame;
+    }
 
-                return *this;
+    // Newest complete record of addr before unit end of a partition: the records no summary covers
+    // yet are scanned first, then, newest first, only the sectors whose summary lists addr.
+    static u16 Newest(u8 partition, u16 addr, s16 end, bool deltas) {
+        int sector = LastSummary(partition);
+        u16 found = LastRecord(partition, addr, sector >= 0 ? Chip::Read(&SummaryAt(partition, sector)->end) : 0, end, deltas);
+        for (; found == NoFrame && sector >= 0; sector--) {
+            const Summary *summary = SummaryAt(partition, sector);
+            const s16 first = Chip::Read(&summary->first);
+            if (first < end && !(Chip::Read(&summary->absent[addr / 8]) & (1 << (addr % 8)))) {
+                const s16 last = Chip::Read(&summary->end);
+                found = LastRecord(partition, addr, first, last < end ? last : end, deltas);
             }
+        }
+        return found;
+    }
 
-            operator bool() const { return (*parent & 0x80) != 0; }
-        };
+    // Newest record of addr before unit end of a partition, tagged with tag, and the frame it applies
+    // to. Like when indexing, a delta whose base isn't before it in the partition doesn't count.
+    static Located Find(u8 partition, u16 addr, s16 end, u16 tag) {
+        while (true) {
+            const u16 entry = Newest(partition, addr, end, true);
+            if (entry == NoFrame) {
+                return {NoFrame, NoFrame};
+            }
+            if (!(entry & IsDelta)) {
+                return {(u16)(entry | tag), (u16)(entry | tag)};
+            }
+            const u16 base = Newest(partition, addr, entry & UnitMask, false);
+            if (base != NoFrame) {
+                return {(u16)(entry | tag), (u16)(base | tag)};
+            }
+            end = entry & UnitMask;
+        }
+    }
 
-      public:
-        void Reset() {
-            for (auto i = 0; i < Size; i++) {
-                progress[i] &= 0x7F;
+    // Where the newest record of addr is. Without an index, the active partition is searched, then
+    // during a copy the sending one.
+    static Located Locate(u16 addr) {
+        auto g = Globals();
+        if constexpr (Indexed) {
+            return {g->FrameIndex[addr], g->BaseIndex[addr]};
+        } else {
+            const Located at = Find(g->ActivePartition, addr, g->NextFrame, 0);
+            if (at.entry != NoFrame || g->Phase != Compaction::Copy) {
+                return at;
             }
+            const u8 sending = g->ActivePartition ^ 1;
+            return Find(sending, addr, MaxUnits(g->Layouts[sending], g->Summarized[sending]), InSending);
         }
+    }
 
-        constexpr bool operator[](size_t index) const { return (progress[index] & 0x80) != 0; }
-        reference operator[](size_t index) { return reference(&progress[index]); }
-    };
+    // Writes the summary of each sector of the active partition the records have moved past. Only
+    // without an index, into partitions that keep summaries.
+    static u16 Summarize() {
+        auto g = Globals();
+        const u8 partition = g->ActivePartition;
+        if (Indexed || !g->Summarized[partition]) {
+            return 0;
+        }
+        const Layout layout = g->Layouts[partition];
+        const u16 deltaFlag = layout == COMPACT ? Delta::Flag : 0;
 
-    class lookupTable {
-      public:
-        static constexpr size_t Size = EEPROMSize / 8;
+        while (true) {
+            s16 unit = TailOf(partition);
+            const int sector = SectorOf(partition, unit);
+            if (SectorOf(partition, g->NextFrame) <= sector) {
+                return 0;
+            }
+
+            alignas(4) Summary summary;
+            for (int i = 0; i < sizeof(summary.absent); i++) {
+                summary.absent[i] = 0xFF;
+            }
+            summary.first = unit;
+            u16 addrs[ScanChunk];
+            while (unit < g->NextFrame && SectorOf(partition, unit) == sector) {
+                const int used = Chip::Scan(RecordAt(partition, unit), UnitSize(layout) * FrameUnits(layout), ScanChunk, 0xFFFF, addrs, deltaFlag, UnitSize(layout));
+                for (int i = 0; i < used && unit < g->NextFrame && SectorOf(partition, unit) == sector; i++) {
+                    const u16 addr = addrs[i] & ~deltaFlag;
+                    if (addr < NumVars) {
+                        summary.absent[addr / 8] &= ~(1 << (addr % 8));
+                    }
+                    unit += (addrs[i] & deltaFlag) ? 1 : FrameUnits(layout);
+                }
+                if (used < ScanChunk) {
+                    break;
+                }
+            }
+            // the records end before NextFrame; the sector stays in the tail
+            if (SectorOf(partition, unit) == sector) {
+                return 0;
+            }
+            summary.end = unit;
+            summary.done = 0xFF;
 
-      private:
-        u8 table[Size];
+            u16 result = Chip::Program(reinterpret_cast<u8 *>(SummaryAt(partition, sector)), reinterpret_cast<const u8 *>(&summary), offsetof(Summary, done));
+            if (result == 0) {
+                result = Chip::WriteByte(&SummaryAt(partition, sector)->done, (u8)0x00);
+            }
+            if (result != 0) {
+                return result;
+            }
+        }
+    }
 
-        class reference {
-          public:
-            u8 *parent;
+    // Indexes the records of a partition in one forward pass, tagging entries with tag; returns the
+    // first free unit. With only set, just the complete records of that variable are indexed. Without
+    // an index, only the records past the summaries are walked to find the free unit.
+    static s16 IndexPartition(u8 partition, u16 tag, u16 only = NoFrame) {
+        auto g = Globals();
+        const Layout layout = g->Layouts[partition];
+        const s16 maxUnits = MaxUnits(layout, g->Summarized[partition]);
+        const u16 deltaFlag = layout == COMPACT ? Delta::Flag : 0;
 
-            reference(u8 *p) : parent(p) {}
-            reference &operator=(u8 val) {
-                *parent = (*parent & 0x80) | (val & 0x7F);
-                return *this;
+        u16 addrs[ScanChunk];
+        s16 unit = Indexed ? 0 : TailOf(partition);
+        while (unit < maxUnits) {
+            const int used = Chip::Scan(RecordAt(partition, unit), UnitSize(layout) * FrameUnits(layout), ScanChunk, 0xFFFF, addrs, deltaFlag, UnitSize(layout));
+            for (int i = 0; i < used && unit < maxUnits; i++) {
+                const bool delta = addrs[i] & deltaFlag;
+                if constexpr (Indexed) {
+                    const u16 addr = addrs[i] & ~deltaFlag;
+                    // a delta needs its base in this partition before it
+                    const bool based = addr < NumVars && g->BaseIndex[addr] != NoFrame && (g->BaseIndex[addr] & InSending) == tag;
+                    const bool wanted = only == NoFrame || (addr == only && (layout != COMPACT || Complete(partition, unit, delta)));
+                    if (addr < NumVars && (!delta || based) && wanted) {
+                        g->FrameIndex[addr] = unit | tag | (delta ? IsDelta : 0);
+                        if (!delta) {
+                            g->BaseIndex[addr] = unit | tag;
+                        }
+                    }
+                }
+                unit += delta ? 1 : FrameUnits(layout);
+            }
+            if (used < ScanChunk) {
+                break;
             }
+        }
 
-            operator u8() const { return (*parent & 0x7F); }
-        };
+        return unit < maxUnits ? unit : maxUnits;
+    }
 
-      public:
-        static constexpr size_t size = EEPROMSize / 8;
+    // Whether the record of an entry was programmed to its end; legacy frames have no check.
+    static bool Intact(u16 entry) {
+        const u8 partition = PartitionOf(entry);
+        return Globals()->Layouts[partition] != COMPACT || Complete(partition, entry & UnitMask, entry & IsDelta);
+    }
 
-        void Reset() {
-            for (auto i = 0; i < Size; i++) {
-                table[i] &= 0x80;
+    // A record cut short by a power loss stays where it is, and records appended after it on the
+    // next run don't make it the last one anymore. Once both partitions are indexed, the records the
+    // index points at are checked; a variable with a torn one is indexed again from its complete
+    // records only. Takes a few record reads per variable, a pass per torn record found.
+    static void DropTorn() {
+        auto g = Globals();
+        for (u16 addr = 0; addr < NumVars; addr++) {
+            const u16 entry = g->FrameIndex[addr];
+            if (entry == NoFrame || (Intact(entry) && ((entry & IsDelta) == 0 || Intact(g->BaseIndex[addr])))) {
+                continue;
+            }
+            g->FrameIndex[addr] = NoFrame;
+            g->BaseIndex[addr] = NoFrame;
+            if (g->Phase == Compaction::Copy) {
+                IndexPartition(g->ActivePartition ^ 1, InSending, addr);
             }
+            IndexPartition(g->ActivePartition, 0, addr);
         }
+    }
 
-        constexpr u8 operator[](size_t index) const { return (table[index] & 0x7F); }
-        reference operator[](size_t index) { return reference(&table[index]); }
+    // Keeps the background eraser off the chip while the journal uses it. Only taken once the
+    // journal is mounted, and never nested.
+    struct Hold {
+        Hold() { Eraser::Acquire(Globals()->Erase); }
+        ~Hold() { Eraser::Release(Globals()->Erase); }
     };
 
-    struct globals {
-        union {
-            compactProgress CompactProgress;
-            lookupTable LookupTable;
-        };
-        s16 LastFrameIndex;
+    // Keeps the interrupt handler from writing out queued variables while RAM alone answers a read,
+    // without waiting for an erase in flight like Hold does.
+    struct Pin {
+        Pin() { Eraser::Pause(Globals()->Erase); }
+        ~Pin() { Eraser::Resume(Globals()->Erase); }
     };
 
-    __attribute__((always_inline)) static globals *Globals() { return reinterpret_cast<globals *>(Align<4>((EWRAM + EWRAM_SIZE - 1) - sizeof(globals))); }
-    __attribute__((always_inline)) static Partition *Partition0() { return reinterpret_cast<Partition *>(FLASH_BASE); }
-    __attribute__((always_inline)) static Partition *Partition1() { return reinterpret_cast<Partition *>(FLASH_BASE + (F.type.romSize / 2)); }
-
-  public:
-    static void Init() {
-        auto activePart = MaybeActivePartition();
-        if (activePart == nullptr) {
-            Format();
+    // Interrupt handler in front of the game's own: ticks the background eraser, and on VBlank,
+    // once the game's handler is done, writes out queued variables. The game may have cleared the
+    // journal's RAM since, so neither happens unless it is still mounted. The code interrupted may
+    // be in the middle of a program at the wait for writes, so the wait is put back on return.
+    static void Irq() {
+        const u16 wait = Backend::CurrentWait();
+        Chip::Install();
+        auto g = Globals();
+        const bool mounted = g->Mounted == MountedMagic;
+        const bool vblank = Backend::VBlankPending();
+        if (Backend::TakeTimerIrq()) {
+            if (mounted) {
+                Eraser::Tick(g->Erase);
+            } else {
+                Backend::StopTimer();
+            }
+        }
+        // the BIOS enters the handler with REG_BASE in r0, and some games rely on it
+        void (*chained)() = *Backend::ChainedIrq();
+        if (chained != nullptr) {
+            reinterpret_cast<void (*)(uintptr_t)>(chained)(REG_BASE);
         }
+        if (vblank && mounted) {
+            Backend::OnUserStack(&FlushInBackground);
+        }
+        Backend::SetWait(wait);
     }
 
-    static void Format() {
-        Chip::EraseChip();
-        Chip::Write((u8)0x00, (u8 *)&Partition0()->header.receiving);
-        Chip::Write((u8)0x00, (u8 *)&Partition0()->header.active);
-    };
+    // Writes out FlushesPerVBlank queued variables, only while that is quick, interrupts stay masked:
+    // not while a hook or an erase has the chip, nor when it would have to finish the previous
+    // compaction or erase the receiving partition first.
+    static void FlushInBackground() {
+        auto g = Globals();
+        for (int i = 0; i < FlushesPerVBlank; i++) {
+            if (g->Mounted != MountedMagic || g->QueueLength == 0 || g->Erase.held || g->Erase.current != Eraser::NoSector) {
+                return;
+            }
+            if (Full() && (g->Phase != Compaction::Idle || !ReceivingErased())) {
+                return;
+            }
 
-    static Maybe<Variable> MaybeReadVar(u16 addr, typename Chip::ReadByteFunc &func, Partition *activePartition = nullptr, bool useHint = true) {
-        if (activePartition == nullptr) {
-            activePartition = ActivePartition();
+            Hold hold;
+            FlushOne();
         }
+    }
 
-        int end = PartitionMaxFrames - 1;
-        auto &lookupTable = Globals()->LookupTable;
+    // Hands the sectors of a partition to the background eraser; they start erasing once the hook returns.
+    static void QueueErase(u8 partition) {
+        auto g = Globals();
+        Backend::HookIrq(&Irq);
+        Eraser::Queue(g->Erase, ((1u << Partition::numSectors) - 1) << (partition * Partition::numSectors));
+        g->Phase = Compaction::Erase;
+    }
 
-        if (useHint) {
-            u32 hintAddr = lookupTable[addr];
-            if (hintAddr != 0) {
-                end = (hintAddr << 3);
+    static u16 EraseSectors(u8 partition) {
+        for (int sector = Partition::numSectors - 1; sector >= 0; sector--) {
+            if (Chip::SectorBlank(partition * Partition::numSectors + sector)) {
+                continue;
+            }
+            u16 result = Chip::EraseSector(partition * Partition::numSectors + sector, true);
+            if (result != 0) {
+                return result;
             }
         }
+        return 0;
+    }
 
-        for (int i = end - 1; i >= 0; i--) {
-            Frame *f = &activePartition->frames[i];
-            u16 varAddr = Chip::Read(&f->addr, func);
-            if (addr == varAddr) {
-                return Chip::Read(&f->data);
+    // Whether the partition a compaction would receive into is erased; it may hold something else,
+    // e.g. a trace dump, or the header of one that never started.
+    static bool ReceivingErased() {
+        const Header header = Chip::Read(&PartitionAt(Globals()->ActivePartition ^ 1)->header);
+        return header.state == ERASED && (header.layout == COMPACT || header.layout == LEGACY) && header.summaries == 0xFF;
+    }
+
+    // Turns the full active partition into the sending one and makes the other one active.
+    static u16 StartCompaction() {
+        auto g = Globals();
+        u8 receivingNum = g->ActivePartition ^ 1;
+        Partition *sending = PartitionAt(g->ActivePartition);
+        Partition *receiving = PartitionAt(receivingNum);
+
+        if (!ReceivingErased()) {
+            u16 result = EraseSectors(receivingNum);
+            if (result != 0) {
+                return result;
             }
-            if (useHint && varAddr != 0xFFFF) {
-                lookupTable[varAddr] = (u8)(i >> 3) + 1;
+        }
+
+        // new frames always go out in the current layout, so compaction also migrates old images
+        Chip::Write(COMPACT, &receiving->header.layout);
+        g->Layouts[receivingNum] = COMPACT;
+        if constexpr (!Indexed) {
+            Chip::Write((u8)0x00, &receiving->header.summaries);
+        }
+        g->Summarized[receivingNum] = !Indexed;
+
+        // mark sending partition as sending
+        Chip::Write((u8)0x00, &sending->header.sending);
+        // mark receiving partition as receiving
+        Chip::Write((u8)0x00, &receiving->header.receiving);
+
+        if constexpr (Indexed) {
+            for (int addr = 0; addr < NumVars; addr++) {
+                if (g->FrameIndex[addr] != NoFrame) {
+                    g->FrameIndex[addr] |= InSending;
+                    g->BaseIndex[addr] |= InSending;
+                }
             }
         }
 
-        return nullptr;
+        g->ActivePartition = receivingNum;
+        g->NextFrame = 0;
+        g->Phase = Compaction::Copy;
+        g->CopyCursor = 0;
+        return 0;
     }
 
-    static Variable ReadVar(u16 addr, typename Chip::ReadByteFunc &func, Partition *activePartition = nullptr) {
-        if (activePartition == nullptr) {
-            activePartition = ActivePartition();
+    static u16 CopyStep() {
+        auto g = Globals();
+        Partition *receiving = PartitionAt(g->ActivePartition);
+
+        for (int steps = 0; steps < CompactFramesPerStep && g->CopyCursor < NumVars; g->CopyCursor++) {
+            u16 addr = g->CopyCursor;
+            // without an index, looking a variable up takes about as long as copying it
+            if constexpr (!Indexed) {
+                steps++;
+            }
+            const Located at = Locate(addr);
+            // rewritten since the compaction started, or never written
+            if (at.entry == NoFrame || !(at.entry & InSending)) {
+                continue;
+            }
+
+            // deltas are folded into the frame they applied to
+            s16 frame = g->NextFrame;
+            g->NextFrame += FrameUnits(g->Layouts[g->ActivePartition]);
+            u16 result = WriteFrame(g->ActivePartition, frame, addr, Resolve(at));
+            if (result != 0) {
+                return result;
+            }
+            Point(addr, frame);
+            if constexpr (Indexed) {
+                steps++;
+            }
         }
 
-        Maybe<Variable> var = MaybeReadVar(addr, func, activePartition);
-        if (var) {
-            return *var;
+        u16 result = Summarize();
+        if (result != 0 || g->CopyCursor < NumVars) {
+            return result;
         }
-        return Variable{.data = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF}};
+
+        // mark receiving partition as active
+        result = Chip::Write((u8)0x00, (u8 *)&receiving->header.active);
+        if (result != 0) {
+            return result;
+        }
+        // mark sending partition as erasing
+        result = Chip::Write((u8)0x00, (u8 *)&PartitionAt(g->ActivePartition ^ 1)->header.erasing);
+        if (result != 0) {
+            return result;
+        }
+
+        QueueErase(g->ActivePartition ^ 1);
+        return 0;
     }
 
-    static Variable ReadVar(u16 addr, Partition *activePartition = nullptr) {
-        typename Chip::ReadByteFunc func;
-        return ReadVar(addr, func, activePartition);
+    static u16 Step() {
+        auto g = Globals();
+
+        u16 result = 0;
+        switch (g->Phase) {
+        case Compaction::Copy:
+            result = CopyStep();
+            break;
+        case Compaction::Erase:
+            if (Eraser::TakeFailure(g->Erase)) {
+                result = 0xA000;
+            } else if (Eraser::Idle(g->Erase)) {
+                g->Phase = Compaction::Idle;
+            }
+            break;
+        case Compaction::Idle:
+            break;
+        }
+
+        // Flash and index disagree now; the next access remounts from flash.
+        if (result != 0) {
+            g->Mounted = 0;
+        }
+        return result;
     }
 
-    static u16 WriteVar(u16 addr, const Variable &data, Partition *activePartition = nullptr, bool useHint = true) { // Start from lowest address and write
-        if (activePartition == nullptr) {
-            activePartition = ActivePartition();
+    // Runs the compaction in progress to its end.
+    static u16 Drain() {
+        auto g = Globals();
+        while (g->Phase != Compaction::Idle) {
+            if (g->Phase == Compaction::Erase) {
+                Eraser::Finish(g->Erase);
+            }
+
+            u16 result = Step();
+            if (result != 0) {
+                return result;
+            }
         }
+        return 0;
+    }
 
-        s16 &lastFrame = Globals()->LastFrameIndex;
+    // Whether the active partition has no room left for a frame.
+    static bool Full() {
+        auto g = Globals();
+        const Layout layout = g->Layouts[g->ActivePartition];
+        return g->NextFrame > MaxUnits(layout, g->Summarized[g->ActivePartition]) - FrameUnits(layout);
+    }
 
-        const Frame newFrame{.addr = addr, .data = data};
-        typename Chip::ReadByteFunc func;
+    // Newest value of a variable that has a record.
+    static Variable Resolve(const Located &at) {
+        Variable value = Chip::Read(DataAt(at.base));
+        if (at.entry & IsDelta) {
+            Chip::Read(reinterpret_cast<const Delta *>(RecordAt(PartitionOf(at.entry), at.entry & UnitMask))).ApplyTo(value);
+        }
+        return value;
+    }
 
-        if (!useHint || lastFrame == 0) {
-            for (int i = 0; i < PartitionMaxFrames; i++) {
-                Frame *f = &activePartition->frames[i];
-                u16 varAddr = Chip::Read(&f->addr, func);
-                if (varAddr == 0xFFFF) {
-                    if (useHint) {
-                        lastFrame = i;
-                        Globals()->LookupTable[addr] = (u8)(i >> 3) + 1;
+    // Puts together the record of data for the active partition in out: a delta against the
+    // variable's base when that is in the active partition and differs in few enough bytes, a frame
+    // otherwise. Returns IsDelta for a delta, 0 for a frame.
+    static u16 BuildRecord(u16 addr, const Variable &data, u16 base, u8 *out) {
+        auto g = Globals();
+        const u8 partition = g->ActivePartition;
+
+        if (g->Layouts[partition] == COMPACT && base != NoFrame && !(base & InSending)) {
+            const Variable old = Chip::Read(DataAt(base));
+            Delta d{};
+            d.addr = addr | Delta::Flag;
+            int changed = 0;
+            for (int i = 0; i < sizeof(data.data) && changed <= Delta::MaxBytes; i++) {
+                if (data.data[i] != old.data[i]) {
+                    if (changed < Delta::MaxBytes) {
+                        d.bytes[changed] = data.data[i];
                     }
-                    return Chip::Write(newFrame, f);
+                    d.mask |= 1 << i;
+                    changed++;
                 }
             }
-        } else if (useHint && lastFrame < PartitionMaxFrames - 1) {
-            Frame *f = &activePartition->frames[lastFrame + 1];
-            Globals()->LookupTable[addr] = (u8)((lastFrame + 1) >> 3) + 1;
-            lastFrame += 1;
-            return Chip::Write(newFrame, f);
+
+            if (changed <= Delta::MaxBytes) {
+                d.check = d.Check();
+                *reinterpret_cast<Delta *>(out) = d;
+                return IsDelta;
+            }
         }
 
-        return TransferPartition(activePartition, newFrame);
+        BuildFrame(g->Layouts[partition], addr, data, out);
+        return 0;
     }
 
-    static u16 TransferPartition(Partition *sending, const Frame &pendingFrame, bool useHint = true) {
-        int sectorStart = 0;
-        Partition *receiving;
-        if (sending == Partition0()) {
-            receiving = Partition1();
-        } else {
-            sectorStart = F.type.sector.count / 2;
-            receiving = Partition0();
+    // Units taken by the record of an entry of the active partition.
+    static u8 RecordUnits(u16 entry) { return (entry & IsDelta) ? 1 : FrameUnits(Globals()->Layouts[Globals()->ActivePartition]); }
+
+    // Makes entry the newest record of addr.
+    static void Point(u16 addr, u16 entry) {
+        if constexpr (Indexed) {
+            Globals()->FrameIndex[addr] = entry;
+            if (!(entry & IsDelta)) {
+                Globals()->BaseIndex[addr] = entry;
+            }
         }
+    }
 
-        // mark sending partition as sending
-        Chip::Write((u8)0x00, &sending->header.sending);
-        // mark receiving partition as receiving
-        Chip::Write((u8)0x00, &receiving->header.receiving);
+    // Appends the record of data, a delta if base allows, to the active partition and points the index at it.
+    static u16 WriteRecord(u16 addr, const Variable &data, u16 base) {
+        auto g = Globals();
+        alignas(4) u8 record[MaxRecordBytes];
+        const u16 entry = g->NextFrame | BuildRecord(addr, data, base, record);
+        g->NextFrame += RecordUnits(entry);
+        u16 result = Chip::Program(RecordAt(g->ActivePartition, entry & UnitMask), record, RecordUnits(entry) * UnitSize(g->Layouts[g->ActivePartition]));
+        if (result != 0) {
+            return result;
+        }
+        Point(addr, entry);
+        return Summarize();
+    }
 
-        Globals()->LastFrameIndex = 0;
-        auto &compactProgress = Globals()->CompactProgress;
-        compactProgress.Reset();
-        compactProgress[pendingFrame.addr] = true;
-
-        // transfer latest vars, by scanning once from the highest address
-        typename Chip::ReadByteFunc func;
-        for (int i = PartitionMaxFrames - 1; i >= 0; i--) {
-
-            const Frame *f = &sending->frames[i];
-            u16 varAddr = Chip::Read(&f->addr, func);
-            if (varAddr != 0xFFFF) {
-                // check if we have already added this variable
-                auto &&prog = compactProgress[varAddr];
-                if (!prog) {
-                    prog = true;
-                    auto result = WriteVar(varAddr, Chip::Read(&f->data), receiving, false);
-                    if (result != 0) {
-                        return result;
-                    }
-                }
+    // Whether the newest record of a variable, entry, is a frame whose data, read into old, only has to lose bits to become data.
+    static bool Overwritable(u16 entry, const Variable &data, Variable &old) {
+        if (entry == NoFrame || (entry & IsDelta)) {
+            return false;
+        }
+
+        old = Chip::Read(DataAt(entry));
+        for (int i = 0; i < sizeof(data.data); i++) {
+            if ((old.data[i] & data.data[i]) != data.data[i]) {
+                return false;
             }
         }
+        return true;
+    }
+
+    // Reprograms the newest record of a variable, entry, in place when it is a frame and data only
+    // clears bits of it; only the bytes that change are programmed. Returns false if it can't be done.
+    static bool Overwrite(u16 entry, const Variable &data, u16 &result) {
+        auto g = Globals();
+        Variable old;
+        if (!Overwritable(entry, data, old)) {
+            return false;
+        }
+
+        const u8 partition = PartitionOf(entry);
+        u8 *record = RecordAt(partition, entry & UnitMask);
+        u8 *dest = record + DataOffset(g->Layouts[partition]);
 
-        // write pending variable
-        auto result = WriteVar(pendingFrame.addr, pendingFrame.data, receiving, false);
+        result = 0;
+        // the check can't follow the data, so the frame is marked as complete before it changes
+        u8 *spare = record + offsetof(Frame, spare);
+        if (g->Layouts[partition] == COMPACT && Chip::Read(spare) != 0) {
+            result = Chip::WriteByte(spare, (u8)0x00);
+        }
+        if (result == 0) {
+            // bytes left at 0xFF aren't programmed
+            Variable changed;
+            for (int i = 0; i < sizeof(data.data); i++) {
+                changed.data[i] = data.data[i] != old.data[i] ? data.data[i] : 0xFF;
+            }
+            result = Chip::Write(changed, reinterpret_cast<const Variable *>(dest));
+        }
+        return true;
+    }
+
+    static u16 Append(u16 addr, const Variable &data) {
+        auto g = Globals();
+        Located at = Locate(addr);
+        // games rewrite their whole save even if only a few blocks changed
+        if (at.entry != NoFrame && Resolve(at) == data) {
+            return 0;
+        }
+
+        u16 result = 0;
+        if (Overwrite(at.entry, data, result)) {
+            return result != 0 ? result : Step();
+        }
+
+        if (Full()) {
+            // a compaction only starts once the previous one is done
+            result = Drain();
+            if (result != 0) {
+                return result;
+            }
+
+            result = StartCompaction();
+            if (result != 0) {
+                g->Mounted = 0;
+                return result;
+            }
+            // the record is in the sending partition now
+            at = Locate(addr);
+        }
+
+        result = WriteRecord(addr, data, at.base);
         if (result != 0) {
             return result;
         }
 
-        // mark receiving partition as active
-        result = Chip::Write((u8)0x00, (u8 *)&receiving->header.active);
+        return Step();
+    }
+
+    static void Dequeue(int count) {
+        auto g = Globals();
+        g->QueueLength -= count;
+        for (int i = 0; i < g->QueueLength; i++) {
+            g->WriteQueue[i] = g->WriteQueue[i + count];
+        }
+    }
+
+    static u16 FlushOne() {
+        auto g = Globals();
+        u16 result = Append(g->WriteQueue[0].addr, g->WriteQueue[0].data);
         if (result != 0) {
             return result;
         }
-        // mark sending partition as erasing
-        result = Chip::Write((u8)0x00, (u8 *)&sending->header.erasing);
+
+        Dequeue(1);
+        return 0;
+    }
+
+    // Writes out the queued variables from the front of the queue whose records fit the active
+    // partition, back to back with a single Chip::Program, so a part that programs a page at a time
+    // loads each page once for all of them. Leaves the first one that can be overwritten in place
+    // or needs a compaction to FlushOne.
+    static u16 FlushGroup() {
+        auto g = Globals();
+        const u8 partition = g->ActivePartition;
+        const Layout layout = g->Layouts[partition];
+        alignas(4) u8 records[WriteQueueDepth * MaxRecordBytes];
+        u16 entries[WriteQueueDepth];
+        const s16 first = g->NextFrame;
+        s16 next = first;
+
+        int count = 0;
+        for (; count < g->QueueLength; count++) {
+            const QueuedWrite &w = g->WriteQueue[count];
+            Variable old;
+            const Located at = Locate(w.addr);
+            if (at.entry != NoFrame && Resolve(at) == w.data) {
+                entries[count] = NoFrame;
+                continue;
+            }
+            if (next > MaxUnits(layout, g->Summarized[partition]) - FrameUnits(layout) || Overwritable(at.entry, w.data, old)) {
+                break;
+            }
+            entries[count] = next | BuildRecord(w.addr, w.data, at.base, records + (next - first) * UnitSize(layout));
+            next += RecordUnits(entries[count]);
+        }
+        if (count == 0) {
+            return FlushOne();
+        }
+
+        g->NextFrame = next;
+        u16 result = Chip::Program(RecordAt(partition, first), records, (next - first) * UnitSize(layout));
         if (result != 0) {
             return result;
         }
+        for (int i = 0; i < count; i++) {
+            if (entries[i] != NoFrame) {
+                Point(g->WriteQueue[i].addr, entries[i]);
+            }
+        }
+        Dequeue(count);
+        return Summarize();
+    }
 
-        // dispatch erase command on all sectors of partition
-        for (int sector = 0; sector < Partition::numSectors; sector++) {
-            u16 result = Chip::EraseSector(sectorStart + sector, true);
+    // Queued variables are grouped unless a compaction is copying, which takes a step per variable.
+    static u16 FlushAll() {
+        while (Globals()->QueueLength != 0) {
+            u16 result = Globals()->Phase != Compaction::Copy ? FlushGroup() : FlushOne();
             if (result != 0) {
                 return result;
             }
         }
+        return 0;
+    }
+
+    static int QueueIndex(u16 addr) {
+        auto g = Globals();
+        for (int i = 0; i < g->QueueLength; i++) {
+            if (g->WriteQueue[i].addr == addr) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    // What a variable that was never written reads as.
+    __attribute__((always_inline)) static Variable Erased() { return Variable{.data = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF}}; }
 
+    __attribute__((always_inline)) static void UpdateShadow(u16 addr, const Variable &data) {
+        if constexpr (Shadowed) {
+            Shadow()[addr] = data;
+        }
+    }
+
+    // Never written: the queue and the index say so without reading the chip. Only under a Pin or a
+    // Hold, a VBlank flush moves a variable from one to the other. Without an index, only for
+    // addresses past the EEPROM.
+    static bool Absent(u16 addr) {
+        if constexpr (Indexed) {
+            return addr >= NumVars || (QueueIndex(addr) < 0 && Globals()->FrameIndex[addr] == NoFrame);
+        }
+        return addr >= NumVars;
+    }
+
+    static Maybe<Variable> Lookup(u16 addr) {
+        if (addr >= NumVars) {
+            return nullptr;
+        }
+
+        int queued = QueueIndex(addr);
+        if (queued >= 0) {
+            return Globals()->WriteQueue[queued].data;
+        }
+
+        const Located at = Locate(addr);
+        if (at.entry == NoFrame) {
+            return nullptr;
+        }
+
+        if constexpr (Shadowed) {
+            return Shadow()[addr];
+        }
+        return Resolve(at);
+    }
+
+  public:
+    static void Init() {
+        Chip::Install();
+        // after a soft reset, writes queued by the previous run are still in RAM
+        if (Globals()->Mounted == MountedMagic) {
+            Hold hold;
+            FlushAll();
+        }
+        Mount();
+        // starts erasing what a cut short compaction left behind
+        Eraser::Release(Globals()->Erase);
+    }
+
+    // Finds the active partition from the header states, indexes it and picks up whatever a power
+    // loss cut short:
+    //   RECEIVING + SENDING   the copy resumes; the receiving partition's frames are the newer ones
+    //   ACTIVE + SENDING      the copy was done, the sending partition is erased
+    //   ACTIVE + RECEIVING    a compaction that never started copying; the receiving one is erased
+    //   ACTIVE + ERASING      the erase is redone
+    //   SENDING + other       a compaction that never marked the receiving partition; the
+    //                         partition stays in use until the next one
+    //   RECEIVING + other     a format that never marked the partition active; it is marked now
+    // The chip is only formatted when neither partition holds any of these states.
+    static Partition *Mount() {
+        auto g = Globals();
+        // keeps the interrupt handler away from the index while it is rebuilt
+        g->Mounted = 0;
+        // after a soft reset or an error, an erase may still be running
+        Eraser::Reset(g->Erase);
+        // lost like on a crash
+        g->QueueLength = 0;
+        if constexpr (Indexed) {
+            for (int i = 0; i < NumVars; i++) {
+                g->FrameIndex[i] = NoFrame;
+                g->BaseIndex[i] = NoFrame;
+            }
+        }
+        g->Phase = Compaction::Idle;
+
+        const Header h0 = Chip::Read(&Partition0()->header);
+        const Header h1 = Chip::Read(&Partition1()->header);
+        const State s0 = h0.state;
+        const State s1 = h1.state;
+        g->Layouts[0] = h0.layout == COMPACT ? COMPACT : LEGACY;
+        g->Layouts[1] = h1.layout == COMPACT ? COMPACT : LEGACY;
+        g->Summarized[0] = h0.summaries == 0;
+        g->Summarized[1] = h1.summaries == 0;
+
+        u8 active;
+        if ((s0 == SENDING && s1 == RECEIVING) || (s0 == RECEIVING && s1 == SENDING)) {
+            // frames in the receiving partition are newer than the ones left in the sending one
+            active = s0 == RECEIVING ? 0 : 1;
+            if constexpr (Indexed) {
+                IndexPartition(active ^ 1, InSending);
+            }
+            g->Phase = Compaction::Copy;
+            g->CopyCursor = 0;
+        } else {
+            auto activePart = MaybeActivePartition();
+            if (activePart == nullptr) {
+                Format();
+                g->Layouts[0] = COMPACT;
+                g->Summarized[0] = !Indexed;
+                activePart = Partition0();
+            }
+            active = activePart == Partition0() ? 0 : 1;
+
+            const State own = active == 0 ? s0 : s1;
+            const State other = active == 0 ? s1 : s0;
+            if (own == RECEIVING) {
+                Chip::Write((u8)0x00, &activePart->header.active);
+            }
+            if (own == ACTIVE && (other == ERASING || other == SENDING || other == RECEIVING)) {
+                QueueErase(active ^ 1);
+            }
+        }
+
+        g->ActivePartition = active;
+        g->NextFrame = IndexPartition(active, 0);
+        if constexpr (Indexed) {
+            DropTorn();
+        }
+        if constexpr (Shadowed) {
+            for (int i = 0; i < NumVars; i++) {
+                const Located at = Locate(i);
+                Shadow()[i] = at.entry != NoFrame ? Resolve(at) : Erased();
+            }
+        }
+        g->Mounted = MountedMagic;
+        return PartitionAt(active);
+    }
+
+    // Only erases what isn't blank already, a chip erase takes seconds on some parts.
+    static void Format() {
+        u32 dirty = 0;
+        for (int sector = 0; sector < F.type.sector.count; sector++) {
+            if (!Chip::SectorBlank(sector)) {
+                dirty |= 1u << sector;
+            }
+        }
+        if (dirty == (u32)((1ull << F.type.sector.count) - 1)) {
+            Chip::EraseChip();
+        } else {
+            for (int sector = F.type.sector.count - 1; sector >= 0; sector--) {
+                if (dirty & (1u << sector)) {
+                    Chip::EraseSector(sector, true);
+                }
+            }
+        }
+        Chip::Write(COMPACT, &Partition0()->header.layout);
+        if constexpr (!Indexed) {
+            Chip::Write((u8)0x00, &Partition0()->header.summaries);
+        }
+        Chip::Write((u8)0x00, (u8 *)&Partition0()->header.receiving);
+        Chip::Write((u8)0x00, (u8 *)&Partition0()->header.active);
+    };
+
+    // Does a bounded amount of pending work: writes out one queued variable or takes a compaction
+    // step. Hook calls do some on their own; calling this when the game is idle gets it done sooner.
+    static u16 Service() {
+        ActivePartition();
+        Hold hold;
+        if (Globals()->QueueLength != 0) {
+            return FlushOne();
+        }
+        return Step();
+    }
+
+    static Maybe<Variable> MaybeReadVar(u16 addr) {
+        ActivePartition();
+        // doesn't touch the chip, an erase in flight goes on
+        if constexpr (Shadowed) {
+            Pin pin;
+            return Lookup(addr);
+        }
+        {
+            Pin pin;
+            if (Absent(addr)) {
+                return nullptr;
+            }
+        }
+        Hold hold;
+        return Lookup(addr);
+    }
+
+    static Variable ReadVar(u16 addr) {
+        if constexpr (Shadowed) {
+            if (Globals()->Mounted != MountedMagic) {
+                ActivePartition();
+            }
+            // reads still move a copy along; an erase goes on in the background
+            if (Globals()->Phase == Compaction::Copy) {
+                Chip::Install();
+                Hold hold;
+                Step();
+            }
+            if (addr < NumVars) {
+                return Shadow()[addr];
+            }
+            return Erased();
+        }
+
+        ActivePartition();
+        // games probe blocks they never wrote, e.g. at boot; no need to wait for an erase in flight
+        {
+            Pin pin;
+            if (Absent(addr)) {
+                return Erased();
+            }
+        }
+        Hold hold;
+        Maybe<Variable> var = Lookup(addr);
+        Step();
+        if (var) {
+            return *var;
+        }
+        return Erased();
+    }
+
+    static u16 WriteVar(u16 addr, const Variable &data, bool wait = true) {
+        if (addr >= NumVars) {
+            return 0x80FF;
+        }
+
+        ActivePartition();
+        Hold hold;
+        auto g = Globals();
+
+        if (!wait) {
+            Maybe<Variable> current = Lookup(addr);
+            if (current && *current == data) {
+                return 0;
+            }
+
+            // written out on VBlank, or by the next hook call that has to write anyway
+            Backend::HookIrq(&Irq);
+            int queued = QueueIndex(addr);
+            if (queued >= 0) {
+                g->WriteQueue[queued].data = data;
+                UpdateShadow(addr, data);
+                return 0;
+            }
+            if (g->QueueLength == WriteQueueDepth) {
+                // one page load costs about as much as loading it with the whole queue
+                u16 result = Chip::PagesPerSector > 1 && g->Phase != Compaction::Copy ? FlushGroup() : FlushOne();
+                if (result != 0) {
+                    return result;
+                }
+            }
+            g->WriteQueue[g->QueueLength++] = QueuedWrite{.addr = addr, .data = data};
+            UpdateShadow(addr, data);
+            return 0;
+        }
+
+        // what the game wrote before this write is on flash before it
+        u16 result = FlushAll();
+        if (result == 0) {
+            result = Append(addr, data);
+        }
+        if (result == 0) {
+            UpdateShadow(addr, data);
+        }
         return result;
     }
 
+    // Writes out every variable written without wait.
+    static u16 Flush() {
+        ActivePartition();
+        Hold hold;
+        return FlushAll();
+    }
+
+    // Runs a whole compaction at once.
+    static u16 TransferPartition() {
+        auto g = Globals();
+        ActivePartition();
+        Hold hold;
+
+        if (g->Phase == Compaction::Idle) {
+            u16 result = StartCompaction();
+            if (result != 0) {
+                g->Mounted = 0;
+                return result;
+            }
+        }
+
+        return Drain();
+    }
+
     static Partition *MaybeActivePartition() {
         auto p0 = Partition0();
         auto p1 = Partition1();
         auto p0hdr = Chip::Read(&p0->header);
+        auto p1hdr = Chip::Read(&p1->header);
 
-        if (p0hdr.state == ACTIVE || p0hdr.state == SENDING) {
+        // a partition that finished receiving is newer than one still marked as sending, and that
+        // one holds everything a receiving one could
+        if (p0hdr.state == ACTIVE) {
             return p0;
         }
-
-        auto p1hdr = Chip::Read(&p1->header);
-        if (p1hdr.state == ACTIVE || p1hdr.state == SENDING) {
+        if (p1hdr.state == ACTIVE) {
+            return p1;
+        }
+        if (p0hdr.state == SENDING) {
+            return p0;
+        }
+        if (p1hdr.state == SENDING) {
+            return p1;
+        }
+        if (p0hdr.state == RECEIVING) {
+            return p0;
+        }
+        if (p1hdr.state == RECEIVING) {
             return p1;
         }
 
         return nullptr;
     }
 
+    // Calls fn with the partition not in use by the journal, if it is fully erased and free for other
+    // data, while the journal keeps the chip. Returns what fn does, 0 if there is no such partition.
+    template <class Fn> static u16 WithSparePartition(Fn &&fn) {
+        ActivePartition();
+        Hold hold;
+        auto active = MaybeActivePartition();
+        if (active == nullptr) {
+            return 0;
+        }
+
+        auto spare = active == Partition0() ? Partition1() : Partition0();
+        if (Chip::Read(&spare->header).state != ERASED) {
+            return 0;
+        }
+        return fn(spare);
+    }
+
+    // Tunes the read wait on the start of a partition that isn't blank, see Chip::CalibrateWait. Meant
+    // for boot, the journal doesn't have to be mounted; false if both partitions start blank.
+    static bool CalibrateWait() {
+        Chip::Install();
+        return Chip::CalibrateWait(Partition0()) || Chip::CalibrateWait(Partition1());
+    }
+
+    // Most RAM the journal takes below the end of work RAM, alignment included; the same for every part.
+    static constexpr u32 RamBytes = sizeof(globals) + 4 + (Shadowed ? sizeof(Variable) * NumVars : 0);
+
+    // Lowest address of the RAM the journal keeps its state in; it doesn't depend on the part.
+    static uintptr_t RamStart() { return Shadowed ? reinterpret_cast<uintptr_t>(Shadow()) : reinterpret_cast<uintptr_t>(Globals()); }
+
     static Partition *ActivePartition() {
-        auto part = MaybeActivePartition();
-        if (part == nullptr) {
-            Format();
-            return Partition0();
+        Chip::Install();
+        auto g = Globals();
+        if (g->Mounted != MountedMagic) {
+            return Mount();
         }
 
-        return part;
+        return PartitionAt(g->ActivePartition);
     }
 };
 
-} // namespace JFlash
\ No newline at end of file
+} // namespace JFlash
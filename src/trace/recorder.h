@@ -0,0 +1,94 @@
+#pragma once
+
+#include <gba/gba.h>
+#include <trace/trace.h>
+
+namespace Trace {
+
+/*
+    Records every EEPROM hook call into a Ring at a fixed RAM address, timestamped with
+    timers Timer and Timer + 1 cascaded into a 32-bit cycle counter.
+
+    The ring survives soft resets. Holding L+R+SELECT while the game accesses its save
+    asks for a dump: the ring is copied as-is into an erased flash area, where it ends
+    up in the save file and can be replayed with jflash_bench --ring.
+*/
+template <uintptr_t Address, u16 Capacity, int Timer> class Recorder {
+    static_assert(Timer >= 0 && Timer <= 2, "the timestamp needs timers Timer and Timer + 1");
+    static_assert(Address % 4 == 0);
+
+    struct Ring {
+        RingHeader header;
+        RingEntry entries[Capacity];
+    };
+
+    static constexpr u16 DumpKeys = L_BUTTON | R_BUTTON | SELECT_BUTTON;
+
+    __attribute__((always_inline)) static Ring *Get() { return reinterpret_cast<Ring *>(Address); }
+
+    // [0] is the counter/reload register, [1] the control register
+    __attribute__((always_inline)) static vu16 *TimerReg(int n) { return reinterpret_cast<vu16 *>(REG_ADDR_TMCNT + n * 4); }
+
+  public:
+    Recorder() = delete;
+
+    static constexpr u32 Size = sizeof(Ring);
+
+    static void Init() {
+        vu16 *lo = TimerReg(Timer);
+        vu16 *hi = TimerReg(Timer + 1);
+        lo[1] = 0;
+        hi[1] = 0;
+        lo[0] = 0;
+        hi[0] = 0;
+        hi[1] = TIMER_ENABLE | TIMER_COUNTUP;
+        lo[1] = TIMER_ENABLE | TIMER_1CLK;
+
+        Ring *ring = Get();
+        if (ring->header.magic != RingMagic || ring->header.version != RingVersion || ring->header.capacity != Capacity) {
+            ring->header = RingHeader{.magic = RingMagic, .version = RingVersion, .capacity = Capacity, .next = 0};
+        }
+    }
+
+    static u32 Now() {
+        u16 hi, lo;
+        do {
+            hi = TimerReg(Timer + 1)[0];
+            lo = TimerReg(Timer)[0];
+        } while (hi != TimerReg(Timer + 1)[0]);
+
+        return ((u32)hi << 16) | lo;
+    }
+
+    static void Record(Op op, u16 addr, const u8 *data, bool wait) {
+        Ring *ring = Get();
+        RingEntry &e = ring->entries[ring->header.next % Capacity];
+        e.addr = addr;
+        e.op = op;
+        e.wait = wait;
+        e.hash = data != nullptr ? Hash(data) : 0;
+        e.time = Now();
+        ring->header.next++;
+    }
+
+    static bool DumpRequested() { return (~REG_KEYINPUT & DumpKeys) == DumpKeys; }
+
+    // dest must be erased and at least Size bytes long.
+    template <class Chip> static u16 Dump(u8 *dest) {
+        return Chip::Program(dest, reinterpret_cast<const u8 *>(Get()), Size);
+    }
+};
+
+// Stand-in used when the recorder is not built in.
+struct NullRecorder {
+    NullRecorder() = delete;
+
+    static constexpr u32 Size = 0;
+
+    static void Init() {}
+    static void Record(Op, u16, const u8 *, bool) {}
+    static bool DumpRequested() { return false; }
+    template <class Chip> static u16 Dump(u8 *) { return 0; }
+};
+
+} // namespace Trace
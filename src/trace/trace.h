@@ -0,0 +1,82 @@
+#pragma once
+
+#include <gba/types.h>
+
+/*
+    Binary format for recorded EEPROM hook calls.
+
+    A trace is a Header followed by Header::count records. Every record starts with an
+    Entry; WRITE entries are followed by the 8 data bytes that were written. All fields
+    are little endian, as on the GBA.
+
+    The on-cart recorder keeps a Ring instead: a fixed number of RingEntry slots that
+    only hold a hash of the data. Traces converted from a ring have FLAG_HASHED_DATA set
+    and carry data derived from those hashes.
+*/
+
+namespace Trace {
+
+constexpr u32 Magic = 0x52545046; // "FPTR"
+constexpr u16 Version = 1;
+
+enum Op : u8 {
+    CONFIGURE = 0,
+    READ = 1,
+    WRITE = 2,
+    // Power cycle: RAM is lost, flash contents are kept.
+    BOOT = 3,
+};
+
+constexpr u16 FLAG_HASHED_DATA = 1 << 0;
+
+struct Header {
+    u32 magic;
+    u16 version;
+    u16 flags;
+    u32 count;
+};
+static_assert(sizeof(Header) == 12);
+
+struct Entry {
+    u8 op;
+    u8 wait;
+    u16 addr;
+    // CPU cycles the game ran for since the previous call returned.
+    u32 delta;
+};
+static_assert(sizeof(Entry) == 8);
+
+constexpr u32 DataSize = 8;
+
+constexpr u32 RingMagic = 0x47525046; // "FPRG"
+constexpr u16 RingVersion = 1;
+
+struct RingHeader {
+    u32 magic;
+    u16 version;
+    u16 capacity;
+    // Total number of calls recorded; the newest entry is at (next - 1) % capacity.
+    u32 next;
+};
+static_assert(sizeof(RingHeader) == 12);
+
+struct RingEntry {
+    u16 addr;
+    u8 op;
+    u8 wait;
+    u32 hash;
+    // CPU cycles from the timer cascade, wraps every 256 seconds.
+    u32 time;
+};
+static_assert(sizeof(RingEntry) == 12);
+
+// FNV-1a over the 8 data bytes of a call.
+inline u32 Hash(const u8 *data) {
+    u32 h = 0x811C9DC5;
+    for (u32 i = 0; i < DataSize; i++) {
+        h = (h ^ data[i]) * 0x01000193;
+    }
+    return h;
+}
+
+} // namespace Trace